@@ -26,32 +26,98 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <getopt.h>
 #include <signal.h>
 #include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <regex.h>
+#include <fnmatch.h>
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
+/** convert nframes of interleaved input samples to non-interleaved float */
+typedef void (*decode_t) (jack_default_audio_sample_t **dst, jack_nframes_t offset,
+		const char *src, unsigned int channels, jack_nframes_t nframes);
+
+/** one coefficient of a sparse mixing matrix */
+typedef struct _matrix_cell {
+	unsigned int out;      /* output port, 0-based */
+	unsigned int in;       /* input channel, 0-based */
+	float gain;
+} matrix_cell_t;
+
 typedef struct _thread_info {
 	pthread_t thread_id;
 	pthread_t mesg_thread_id;
-	jack_nframes_t duration;
+	uint64_t duration;      /* frames, 0: unlimited */
+	double seconds;         /* --duration, converted once the sample-rate is known */
 	jack_nframes_t rb_size;
 	jack_client_t *client;
 	unsigned int channels;
+	unsigned int inputs;    /* interleaved channels in the input */
+	matrix_cell_t *matrix;  /* routing/mixing, sorted by output, or NULL */
+	unsigned int ncells;
 	volatile int can_capture;
 	volatile int can_process;
+	volatile int jack_lost;
+	volatile int connect_pending;
+	volatile int io_done;
+	volatile int freewheeling;
+	volatile int io_wait;   /* process() is blocked waiting for the io thread */
+	volatile int eof;       /* io thread: no more data will be queued */
+	volatile int idle;      /* io thread: waiting for the playlist */
+	volatile int drained;   /* process: all queued data has been played */
+	int want_reconnect;
+	int io_policy;          /* scheduling class of the io thread */
+	int io_priority;        /* >0: absolute, <0: relative to JACK, 0: unchanged */
+	const char *io_cpus;    /* CPU affinity of the io thread, or NULL */
+	int want_mlock;
+	int low_latency;
+	size_t max_fill;        /* low-latency: bytes to keep in the ringbuffer */
+	jack_nframes_t period;
+	volatile jack_nframes_t latency;  /* published latency of the ports */
+	volatile int latency_pending;
+	jack_nframes_t latency_peak;     /* highest latency in the current window */
+	struct timespec latency_window;   /* start of the current window */
+	jack_nframes_t samplerate;
+	const char *client_name;
+	char **destination_names;
+	struct timespec start_mono;  /* startup, to measure the time to the first sample */
+	struct timespec first_time;
+	atomic_int first_sample;     /* 1: process() handled the first samples, 2: reported */
 	float prebuffer;
-	int readfd;
+	int readfd;       /* current input, -1 if none */
+	int readflags;    /* original file status flags of stdin */
+	int readfifo;     /* the input is a pipe */
+	char **files;     /* queue of input files */
+	unsigned int nfiles;
+	unsigned int next_file;
+	int playlistfd;   /* file or fifo to read further file-names from, or -1 */
+	char playlist[1024];
+	size_t playlist_len;
+	uint64_t total_captured;
+	size_t partial;   /* bytes of an incomplete frame in the ringbuffer's write-space */
 	int format;
+	decode_t decode;
 	/**format:
 	 * bit0,1: 16/24/8/32(float)
 	 * bit8:   signed/unsiged (0x10)
@@ -62,20 +128,96 @@ typedef struct _thread_info {
 
 #define IS_FMTFLT ((info->format&0x20))
 #define IS_BIGEND (info->format&0x40)
-#define IS_FMT32B ((info->format&0x23)==3)
-#define IS_FMT24B ((info->format&3)==1)
-#define IS_FMT16B ((info->format&3)==0)
-#define IS_FMT08B ((info->format&3)==2)
 #define IS_SIGNED (!(info->format&0x10))
 
 #define SAMPLESIZE ((info->format&2)?((info->format&1)?4:1):((info->format&1)?3:2))
-#define POWHX ((info->format&2)?((info->format&1)?0:127):((info->format&1)? 8388607:32767))
-#define POWHS ((info->format&2)?((info->format&1)?2147483648.0:128.0):((info->format&1)? 8388608.0:32768.0))
 
-#define FMTOFF ((IS_SIGNED)?0.0:POWHX)
-#define FMTMLT (POWHS)
+/* Sample conversion is specialized at compile-time for every input
+ * format, so that the inner loop has no per-sample format decisions.
+ * Unsigned integers are offset by 2^(bits-1), as jack-stdout and sox write
+ * them: flipping the sign bit turns them into signed ones. */
+#define DECODE_INT(NAME, BYTES, UNSIGNED, BIGEND) \
+static void NAME (jack_default_audio_sample_t **dst, jack_nframes_t offset, \
+		const char *src, unsigned int channels, jack_nframes_t nframes) { \
+	const float mult = 1.f / (float) (1U << (8 * BYTES - 1)); \
+	const unsigned char *bytes = (const unsigned char *) src; \
+	jack_nframes_t i; \
+	unsigned int chn, b; \
+	for (i = offset; i < offset + nframes; ++i) { \
+		for (chn = 0; chn < channels; ++chn) { \
+			uint32_t d = 0; \
+			for (b = 0; b < BYTES; ++b) \
+				d |= (uint32_t) bytes[BIGEND ? BYTES - 1 - b : b] << (8 * b); \
+			if (UNSIGNED) \
+				d ^= 1U << (8 * BYTES - 1); \
+			if (d & (1U << (8 * BYTES - 1))) \
+				d |= 0xffffffffU << (8 * BYTES - 1); \
+			dst[chn][i] = (jack_default_audio_sample_t) (int32_t) d * mult; \
+			bytes += BYTES; \
+		} \
+	} \
+}
+
+DECODE_INT(decode_s8,     1, 0, 0)
+DECODE_INT(decode_u8,     1, 1, 0)
+DECODE_INT(decode_s16le,  2, 0, 0)
+DECODE_INT(decode_u16le,  2, 1, 0)
+DECODE_INT(decode_s16be,  2, 0, 1)
+DECODE_INT(decode_u16be,  2, 1, 1)
+DECODE_INT(decode_s24le,  3, 0, 0)
+DECODE_INT(decode_u24le,  3, 1, 0)
+DECODE_INT(decode_s24be,  3, 0, 1)
+DECODE_INT(decode_u24be,  3, 1, 1)
+DECODE_INT(decode_s32le,  4, 0, 0)
+DECODE_INT(decode_u32le,  4, 1, 0)
+DECODE_INT(decode_s32be,  4, 0, 1)
+DECODE_INT(decode_u32be,  4, 1, 1)
+
+static void decode_float (jack_default_audio_sample_t **dst, jack_nframes_t offset,
+		const char *src, unsigned int channels, jack_nframes_t nframes) {
+	const float *d = (const float *) src;
+	jack_nframes_t i;
+	unsigned int chn;
+	for (i = offset; i < offset + nframes; ++i)
+		for (chn = 0; chn < channels; ++chn)
+			dst[chn][i] = *d++;
+}
+
+static void decode_float_swap (jack_default_audio_sample_t **dst, jack_nframes_t offset,
+		const char *src, unsigned int channels, jack_nframes_t nframes) {
+	jack_nframes_t i;
+	unsigned int chn;
+	for (i = offset; i < offset + nframes; ++i) {
+		for (chn = 0; chn < channels; ++chn) {
+			/* swap float endianess */
+			char *fout = (char *) &dst[chn][i];
+			fout[0] = src[3];
+			fout[1] = src[2];
+			fout[2] = src[1];
+			fout[3] = src[0];
+			src += 4;
+		}
+	}
+}
+
+decode_t select_decoder (jack_thread_info_t *info) {
+	/* indexed by [bytes - 1][unsigned][big-endian] */
+	static const decode_t decoders[4][2][2] = {
+		{ { decode_s8,    decode_s8    }, { decode_u8,    decode_u8    } },
+		{ { decode_s16le, decode_s16be }, { decode_u16le, decode_u16be } },
+		{ { decode_s24le, decode_s24be }, { decode_u24le, decode_u24be } },
+		{ { decode_s32le, decode_s32be }, { decode_u32le, decode_u32be } },
+	};
+	if (IS_FMTFLT)
+		return IS_BIGEND ? decode_float_swap : decode_float;
+	return decoders[SAMPLESIZE - 1][IS_SIGNED ? 0 : 1][IS_BIGEND ? 1 : 0];
+}
+
+/* frames mixed at a time when a matrix is used */
+#define MIX_BLOCK 1024
 
-#define BE(i) ( (IS_BIGEND)?(SAMPLESIZE-i-1):i)
+/* nanoseconds between latency updates */
+#define LATENCY_WINDOW 1000000000L
 
 /* JACK data */
 jack_port_t **ports;
@@ -84,99 +226,457 @@ jack_nframes_t nframes;
 
 /* Synchronization between process thread and disk thread. */
 jack_ringbuffer_t *rb;
-pthread_mutex_t io_thread_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  data_ready = PTHREAD_COND_INITIALIZER;
+char *frame; /* a frame that wraps around the end of rb */
+jack_default_audio_sample_t **mix; /* decoded input channels */
+int wake_pipe[2] = { -1, -1 };
+
+/* freewheeling: process() waits for the io thread instead of losing data */
+pthread_mutex_t io_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  io_progress_ready = PTHREAD_COND_INITIALIZER;
+unsigned long io_progress = 0;
+
+/* Synchronization between JACK notifications and the main thread. */
+pthread_mutex_t ctrl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  ctrl_cond = PTHREAD_COND_INITIALIZER;
 
 /* global options/status */
 int want_quiet = 0;
 volatile int run = 1;
-long underruns = 0;
+atomic_long underruns = 0;
 
-void * io_thread (void *arg) {
-	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+/* wake up the io thread, this is async-signal and realtime safe */
+void wake_io (void) {
+	const char c = 0;
+	if (write(wake_pipe[1], &c, 1) < 0) {
+		; /* pipe is full, io thread is awake already */
+	}
+}
 
-	jack_nframes_t total_captured = 0;
-	const size_t bytes_per_frame = info->channels * SAMPLESIZE;
-	void *framebuf = malloc (bytes_per_frame);
+/* called by the io thread after moving data */
+void signal_progress (void) {
+	pthread_mutex_lock(&io_progress_lock);
+	++io_progress;
+	pthread_cond_broadcast(&io_progress_ready);
+	pthread_mutex_unlock(&io_progress_lock);
+}
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	pthread_mutex_lock(&io_thread_lock);
+/* freewheeling: block process() until the io thread made progress */
+void wait_progress (jack_thread_info_t *info) {
+	pthread_mutex_lock(&io_progress_lock);
+	const unsigned long seq = io_progress;
+	info->io_wait = 1;
+	wake_io();
+	while (run && !info->io_done && seq == io_progress) {
+		pthread_cond_wait(&io_progress_ready, &io_progress_lock);
+	}
+	info->io_wait = 0;
+	pthread_mutex_unlock(&io_progress_lock);
+}
 
-	int readerror =0;
-	size_t roff = 0;
+/* bytes that may be queued in the ringbuffer. In low-latency
+ * mode the fill-level is limited to max_fill */
+size_t input_space (jack_thread_info_t *info) {
+	const size_t space = jack_ringbuffer_write_space(rb);
+	if (info->max_fill > 0) {
+		const size_t fill = jack_ringbuffer_read_space(rb);
+		if (fill >= info->max_fill)
+			return 0;
+		if (space > info->max_fill - fill)
+			return info->max_fill - fill;
+	}
+	return space;
+}
 
-	while (run && !readerror) {
-		/* Read the data one frame at a time.  This is
-		 * inefficient, but makes things simpler. */
-		while (info->can_capture &&
-		       (jack_ringbuffer_write_space (rb) >= bytes_per_frame)) {
+/* check the type of a newly opened input */
+void input_opened (jack_thread_info_t *info) {
+	struct stat st;
+	info->readfifo = fstat(info->readfd, &st) == 0 && S_ISFIFO(st.st_mode);
+#ifdef F_SETPIPE_SZ
+	if (info->readfifo && info->low_latency) {
+		/* keep as little data as possible queued in the pipe */
+		fcntl(info->readfd, F_SETPIPE_SZ, 4096);
+	}
+#endif
+}
 
-			if (info->duration > 0 && total_captured >= info->duration) {
-				if (!want_quiet)
-					fprintf(stderr, "io thread finished\n");
-				readerror=1;
+/* publish the latency: data in the ringbuffer, plus data queued in the
+ * input pipe. At most once per LATENCY_WINDOW, the highest latency seen
+ * during the window is published if it differs by a period or 10%. */
+void update_latency (jack_thread_info_t *info) {
+	const size_t bytes_per_frame = info->inputs * SAMPLESIZE;
+	size_t bytes = jack_ringbuffer_read_space(rb) + info->partial;
+	jack_nframes_t latency, threshold;
+	struct timespec now;
+#ifdef FIONREAD
+	int queued;
+	if (info->readfd >= 0 && info->readfifo
+			&& ioctl(info->readfd, FIONREAD, &queued) == 0 && queued > 0)
+		bytes += queued;
+#endif
+	latency = bytes / bytes_per_frame;
+	if (latency > info->latency_peak)
+		info->latency_peak = latency;
+
+	/* the fill-level changes every period, so only the peak of each
+	 * window is considered, and only larger changes are published */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - info->latency_window.tv_sec) * 1000000000L
+			+ (now.tv_nsec - info->latency_window.tv_nsec) < LATENCY_WINDOW)
+		return;
+	threshold = info->latency / 10 > info->period ? info->latency / 10 : info->period;
+	if (info->latency_peak + threshold <= info->latency || info->latency_peak >= info->latency + threshold) {
+		pthread_mutex_lock(&ctrl_lock);
+		info->latency = info->latency_peak;
+		info->latency_pending = 1;
+		pthread_cond_signal(&ctrl_cond);
+		pthread_mutex_unlock(&ctrl_lock);
+	}
+	info->latency_window = now;
+	info->latency_peak = latency;
+}
+
+/* read as much data as the ringbuffer can hold without blocking.
+ * Only complete frames are committed to the ringbuffer.
+ * returns -1 on error, 1 on EOF, 2 when the duration was reached, 0 otherwise */
+int read_input (jack_thread_info_t *info) {
+	const size_t bytes_per_frame = info->inputs * SAMPLESIZE;
+	jack_ringbuffer_data_t vec[2];
+
+	jack_ringbuffer_get_write_vector(rb, vec);
+
+	while (1) {
+		/* append to the incomplete frame, if any */
+		const size_t off = info->partial;
+		const size_t room = input_space(info);
+		size_t len;
+		char *buf;
+
+		if (off >= room)
+			break; /* ringbuffer is full */
+
+		if (off < vec[0].len) {
+			buf = vec[0].buf + off;
+			len = vec[0].len - off;
+		} else if (off - vec[0].len < vec[1].len) {
+			buf = vec[1].buf + off - vec[0].len;
+			len = vec[1].len - (off - vec[0].len);
+		} else {
+			break; /* ringbuffer is full */
+		}
+
+		if (len > room - off) len = room - off;
+		if (info->duration > 0) {
+			const uint64_t left = (info->duration - info->total_captured) * bytes_per_frame - info->partial;
+			if (len > left) len = left;
+		}
+		if (len == 0)
+			break;
+
+		const ssize_t rv = read(info->readfd, buf, len);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (!want_quiet)
+				fprintf(stderr, "read error: %s\n", strerror(errno));
+			return -1;
+		}
+		if (rv == 0)
+			return 1; /* EOF */
+
+		info->partial += rv;
+		if (info->partial >= bytes_per_frame) {
+			const size_t frames = info->partial / bytes_per_frame;
+			jack_ringbuffer_write_advance(rb, frames * bytes_per_frame);
+			info->total_captured += frames;
+			info->partial -= frames * bytes_per_frame;
+			jack_ringbuffer_get_write_vector(rb, vec);
+		}
+	}
+
+	if (info->duration > 0 && info->total_captured >= info->duration) {
+		if (!want_quiet)
+			fprintf(stderr, "io thread finished\n");
+		return 2;
+	}
+	return 0;
+}
+
+void close_input (jack_thread_info_t *info) {
+	if (info->readfd != fileno(stdin)) {
+		close(info->readfd);
+	}
+	if (info->partial > 0 && !want_quiet) {
+		fprintf(stderr, "Note: discarded incomplete frame at end of file.\n");
+	}
+	info->readfd = -1;
+	info->partial = 0;
+}
+
+/* read available data from the playlist without blocking.
+ * returns -1 at EOF or on error, 1 if data was read, 0 otherwise */
+int read_playlist (jack_thread_info_t *info) {
+	const size_t len = sizeof(info->playlist) - info->playlist_len - 1;
+	ssize_t rv;
+
+	if (len == 0) {
+		fprintf(stderr, "playlist entry too long, ignored.\n");
+		info->playlist_len = 0;
+		return 1;
+	}
+	rv = read(info->playlistfd, info->playlist + info->playlist_len, len);
+	if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (rv <= 0)
+		return -1;
+	info->playlist_len += rv;
+	return 1;
+}
+
+/* get next file-name from the queue or a complete line of the playlist */
+int next_filename (jack_thread_info_t *info, char *fn, size_t len) {
+	char *eol;
+	size_t n;
+
+	if (info->next_file < info->nfiles) {
+		strncpy(fn, info->files[info->next_file++], len - 1);
+		fn[len - 1] = '\0';
+		return 0;
+	}
+
+	info->playlist[info->playlist_len] = '\0';
+	eol = strchr(info->playlist, '\n');
+	if (!eol && (info->playlistfd >= 0 || info->playlist_len == 0))
+		return -1;
+
+	/* at the end of the playlist, the last line may lack a newline */
+	n = eol ? eol - info->playlist : info->playlist_len;
+	if (n >= len) n = len - 1;
+	memcpy(fn, info->playlist, n);
+	fn[n] = '\0';
+
+	n = eol ? eol - info->playlist + 1 : info->playlist_len;
+	memmove(info->playlist, info->playlist + n, info->playlist_len - n);
+	info->playlist_len -= n;
+	return 0;
+}
+
+/* open the next input file from the queue or the playlist.
+ * returns 0 if a file was opened or more may follow, -1 at the end */
+int open_next (jack_thread_info_t *info) {
+	char fn[1024];
+
+	while (1) {
+		if (next_filename(info, fn, sizeof(fn)) == 0) {
+			if (strlen(fn) == 0)
+				continue;
+			if ((info->readfd = open(fn, O_RDONLY | O_NONBLOCK)) < 0) {
+				fprintf(stderr, "Can not open file '%s': %s\n", fn, strerror(errno));
+				continue;
+			}
+			input_opened(info);
+			info->idle = 0;
+			return 0;
+		}
+
+		if (info->playlistfd < 0)
+			return -1;
+
+		switch (read_playlist(info)) {
+			case 1:
+				continue;
+			case 0:
+				/* wait for more entries, play remaining data meanwhile */
+				info->idle = 1;
+				return 0;
+			default:
+				close(info->playlistfd);
+				info->playlistfd = -1;
 				break;
+		}
+	}
+}
+
+/* report the time from startup until process() handled the first samples */
+void report_startup (jack_thread_info_t *info) {
+	if (atomic_load_explicit(&info->first_sample, memory_order_acquire) != 1)
+		return;
+	atomic_store_explicit(&info->first_sample, 2, memory_order_relaxed);
+	if (!want_quiet) {
+		fprintf(stderr, "first samples after %.1f ms (%u ports)\n",
+				(info->first_time.tv_sec - info->start_mono.tv_sec) * 1e3
+				+ (info->first_time.tv_nsec - info->start_mono.tv_nsec) * 1e-6,
+				info->channels);
+	}
+}
+
+void * io_thread (void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	struct pollfd pfd[2];
+
+	while (run) {
+		nfds_t n = 1;
+
+		if (info->readfd < 0 && open_next(info)) {
+			break; /* end of queue */
+		}
+
+		if (info->readfd >= 0 && input_space(info) > info->partial) {
+			const int rv = read_input(info);
+			if (rv == 2) {
+				break;
+			} else if (rv != 0) {
+				/* continue gap-less with next file */
+				close_input(info);
+				continue;
 			}
+		}
 
-			#if 0 /* wait (indefinitley) for read-ready */
-			fd_set fd;
-			FD_ZERO(&fd);
-			FD_SET(fileno(info->fd), &fd);
-			select(fileno(info->fd), &fd, NULL, NULL, NULL);
-			#endif
+		pfd[0].fd = wake_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		if (info->readfd < 0) {
+			/* wait for playlist entries */
+			pfd[1].fd = info->playlistfd;
+			pfd[1].events = POLLIN;
+			pfd[1].revents = 0;
+			++n;
+		} else if (input_space(info) > info->partial) {
+			/* only wait for input if there is space to store it */
+			pfd[1].fd = info->readfd;
+			pfd[1].events = POLLIN;
+			pfd[1].revents = 0;
+			++n;
+		}
 
-			int rv = read(info->readfd, framebuf+roff, bytes_per_frame-roff);
+		signal_progress();
+		update_latency(info);
+		report_startup(info);
 
-			if (rv < 0)  {readerror=1; break;} /* error */
-			else if (rv == 0) {readerror=1; break;} /* EOF */
-			else if (rv < bytes_per_frame) {roff=rv; continue;}
-			else roff=0;
+		if (poll(pfd, n, -1) < 0 && errno != EINTR) {
+			fprintf(stderr, "FATAL: poll error: %s\n", strerror(errno));
+			break;
+		}
 
-			jack_ringbuffer_write(rb, framebuf, bytes_per_frame);
-			++total_captured;
+		if (pfd[0].revents & POLLIN) {
+			char buf[64];
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0) ;
 		}
-		if (!readerror && info->prebuffer == 0)
-			pthread_cond_wait(&data_ready, &io_thread_lock);
 	}
 
 	//fprintf(stderr, "jack-stdin: EOF..\n"); /* DEBUG */
 
-	/* wait until all data is processed */
-	while (run && info->prebuffer == 0 &&
-			jack_ringbuffer_read_space(rb) >
-			jack_get_buffer_size(info->client) * bytes_per_frame) {
-		usleep(10000);
-		//fprintf(stderr, "waiting...\n");usleep(200000); /* DEBUG */
+	/* wait until process() has played all remaining data */
+	info->eof = 1;
+	signal_progress();
+	pfd[0].fd = wake_pipe[0];
+	pfd[0].events = POLLIN;
+	while (run && !info->drained) {
+		char buf[64];
+		report_startup(info);
+		if (poll(pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		while (read(wake_pipe[0], buf, sizeof(buf)) > 0) ;
 	}
-
-	pthread_mutex_unlock(&io_thread_lock);
-	free(framebuf);
+	report_startup(info);
+
+	/* wake up main thread */
+	pthread_mutex_lock(&ctrl_lock);
+	info->io_done = 1;
+	pthread_cond_signal(&ctrl_cond);
+	pthread_mutex_unlock(&ctrl_lock);
+	signal_progress();
 	return 0;
 }
 	
+static void mix_gain (jack_default_audio_sample_t * restrict dst,
+		const jack_default_audio_sample_t * restrict src, const float gain, jack_nframes_t nframes) {
+	jack_nframes_t i;
+	for (i = 0; i < nframes; ++i)
+		dst[i] = gain * src[i];
+}
+
+static void mix_add (jack_default_audio_sample_t * restrict dst,
+		const jack_default_audio_sample_t * restrict src, const float gain, jack_nframes_t nframes) {
+	jack_nframes_t i;
+	for (i = 0; i < nframes; ++i)
+		dst[i] += gain * src[i];
+}
+
+/* apply the matrix to nframes (<= MIX_BLOCK) of decoded input channels,
+ * the result is written to the output ports starting at offset. */
+void mix_matrix (jack_thread_info_t *info, jack_nframes_t offset, jack_nframes_t nframes) {
+	const matrix_cell_t *cell = info->matrix;
+	const matrix_cell_t *end = info->matrix + info->ncells;
+	unsigned int chn;
+
+	for (chn = 0; chn < info->channels; ++chn) {
+		if (cell == end || cell->out != chn) {
+			/* unused output port */
+			memset(out[chn] + offset, 0, nframes * sizeof(jack_default_audio_sample_t));
+			continue;
+		}
+		mix_gain(out[chn] + offset, mix[cell->in], cell->gain, nframes);
+		for (++cell; cell != end && cell->out == chn; ++cell)
+			mix_add(out[chn] + offset, mix[cell->in], cell->gain, nframes);
+	}
+}
+
 int process (jack_nframes_t nframes, void *arg) {
 	int chn;
-	size_t i;
+	jack_nframes_t i, n;
 	jack_thread_info_t *info = (jack_thread_info_t *) arg;
 
-	if ((!info->can_process)) return 0;
+	if (!info->can_process) return 0;
+
+	/* JACK does not clear output buffers, always write to them */
+	for (chn = 0; chn < info->channels; ++chn)
+		out[chn] = jack_port_get_buffer(ports[chn], nframes);
 
-	const size_t bytes_per_frame = info->channels * SAMPLESIZE;
+	if (info->drained) {
+		/* all data was played, output silence until the client is closed */
+		for (chn = 0; chn < info->channels; ++chn)
+			memset(out[chn], 0, nframes * sizeof(jack_default_audio_sample_t));
+		return 0;
+	}
+
+	const size_t bytes_per_frame = info->inputs * SAMPLESIZE;
+
+	if (info->freewheeling && info->can_capture) {
+		/* lossless, wait for the io thread to queue a whole period */
+		info->prebuffer = 0.0;
+		while (run && !info->io_done && !info->eof && !info->idle
+				&& jack_ringbuffer_read_space(rb) < bytes_per_frame * nframes) {
+			wait_progress(info);
+		}
+	}
+
+	/* query eof before the read-space: all data is queued before eof is set */
+	const int eof = info->eof;
+	const int flush = eof || info->idle;
 	const jack_nframes_t rbrs = jack_ringbuffer_read_space(rb);
+	jack_nframes_t avail = nframes;
 
   /* initial pre-buffer. */
-	if (rbrs < ceil(info->rb_size * info->prebuffer / 100.0)) {
+	if (!flush && rbrs < ceil(info->rb_size * info->prebuffer / 100.0)) {
 		//fprintf(stderr,"pre-buffer (%.1f%%)\n", 100.0 * (float) rbrs / (float)info->rb_size); /* DEBUG */
+		for (chn = 0; chn < info->channels; ++chn)
+			memset(out[chn], 0, nframes * sizeof(jack_default_audio_sample_t));
 		return 0;
 	}
 	info->prebuffer=0.0;
 
-	for (chn = 0; chn < info->channels; ++chn)
-		out[chn] = jack_port_get_buffer(ports[chn], nframes);
+	/* at the end (or while waiting for the playlist),
+	 * play the remaining frames and pad with silence */
+	if (flush && rbrs < bytes_per_frame * nframes) {
+		avail = rbrs / bytes_per_frame;
+	}
 
 	/* Do nothing until we're ready to begin. and
 	   only dequeue samples if a whole period is avail. */
-	if ((!info->can_capture) || (rbrs < bytes_per_frame * nframes)) {
+	if ((!info->can_capture) || (!flush && rbrs < bytes_per_frame * nframes)) {
 		/* silence */
 		for (chn = 0; chn < info->channels; ++chn) {
 			memset(out[chn], 0, nframes * sizeof(jack_default_audio_sample_t));
@@ -184,83 +684,213 @@ int process (jack_nframes_t nframes, void *arg) {
 		
 		/* count underruns */
 		if (info->can_capture && rbrs < bytes_per_frame * nframes) {
-			underruns++;
+			atomic_fetch_add_explicit(&underruns, 1, memory_order_relaxed);
 		  fprintf(stderr,"underrun..\n");
 		}
 		return 0;
 	}
 
+	if (!atomic_load_explicit(&info->first_sample, memory_order_relaxed)) {
+		clock_gettime(CLOCK_MONOTONIC, &info->first_time);
+		atomic_store_explicit(&info->first_sample, 1, memory_order_release);
+	}
+
 	/* dequeue interleaved samples from a single ringbuffer. */
-	for (i = 0; i < nframes; i++) {
+	for (i = 0; i < avail; i += n) {
+		jack_ringbuffer_data_t vec[2];
+		jack_default_audio_sample_t **dst = out;
+		jack_nframes_t offset = i;
+
+		jack_ringbuffer_get_read_vector(rb, vec);
+		n = vec[0].len / bytes_per_frame;
+		if (n > avail - i)
+			n = avail - i;
+		if (info->matrix) {
+			/* decode to the mix buffers first */
+			if (n > MIX_BLOCK)
+				n = MIX_BLOCK;
+			dst = mix;
+			offset = 0;
+		}
+		if (n > 0) {
+			/* convert directly from the ringbuffer */
+			info->decode(dst, offset, vec[0].buf, info->inputs, n);
+			jack_ringbuffer_read_advance(rb, n * bytes_per_frame);
+		} else {
+			/* the next frame wraps around the end of the ringbuffer */
+			jack_ringbuffer_read(rb, frame, bytes_per_frame);
+			info->decode(dst, offset, frame, info->inputs, 1);
+			n = 1;
+		}
+		if (info->matrix)
+			mix_matrix(info, i, n);
+	}
 
+	if (avail < nframes) {
 		for (chn = 0; chn < info->channels; ++chn) {
-			jack_default_audio_sample_t js;
-			if (IS_FMTFLT) {
-				/* 32 bit float */
-				float d;
-				jack_ringbuffer_read (rb, (void *) &d, SAMPLESIZE);
-				if (IS_BIGEND) {
-					/* swap float endianess */
-					char *flin = (char*) & d;
-					char *fout = (char*) & js;
-					fout[0] = flin[3];
-					fout[1] = flin[2];
-					fout[2] = flin[1];
-					fout[3] = flin[0];
-				} else {
-				  js = d;
-				}
-				out[chn][i] = (jack_default_audio_sample_t) js;
-			} else {
-				/* 8/16/24/32 LE/BE signed/unsigned */
-				char bytes[4];
-				jack_ringbuffer_read (rb, (void *) &bytes, SAMPLESIZE);
-
-				int32_t d=0;
-				d|=   ( ((int32_t)bytes[BE(0)]&0xff)     );
-
-				if (IS_FMT16B || IS_FMT24B || IS_FMT32B)
-					d|= ( ((int32_t)bytes[BE(1)]&0xff)<<8  );
-				if (IS_FMT24B || IS_FMT32B)
-					d|= ( ((int32_t)bytes[BE(2)]&0xff)<<16 );
-				if (IS_FMT32B)
-					d|= ( ((int32_t)bytes[BE(3)]&0xff)<<24 );
-
-
-				if (IS_FMT32B) {
-					if (!IS_SIGNED) d^=0x80000000;
-				} else if (IS_SIGNED && (bytes[BE((SAMPLESIZE-1))]&0x80)) {
-					const int32_t mask[3] = { 0xffffff00, 0xffff0000, 0xff000000 };
-					d|= mask[SAMPLESIZE-1];
-				}
+			memset(out[chn] + avail, 0, (nframes - avail) * sizeof(jack_default_audio_sample_t));
+		}
+	}
 
-				out[chn][i] = (jack_default_audio_sample_t) ((float)(d-FMTOFF) / FMTMLT);
-			}
-		} /* end - foreach channel */
-	} /* end - foreach sample */
+	if (eof && jack_ringbuffer_read_space(rb) < bytes_per_frame) {
+		info->drained = 1;
+	}
 
 	/* Tell the io thread there that frames have been dequeued. */
-	if (pthread_mutex_trylock(&io_thread_lock) == 0) {
-	    pthread_cond_signal(&data_ready);
-	    pthread_mutex_unlock(&io_thread_lock);
-	}
+	wake_io();
 
 	return 0;
 }
 
+void jack_freewheel (int starting, void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	info->freewheeling = starting;
+}
+
+/* the output ports deliver data that was buffered for info->latency frames */
+void jack_latency (jack_latency_callback_mode_t mode, void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	jack_latency_range_t range;
+	unsigned int i;
+
+	if (mode != JackCaptureLatency || !info->can_process)
+		return;
+	range.min = range.max = info->latency;
+	for (i = 0; i < info->channels; i++)
+		jack_port_set_latency_range(ports[i], mode, &range);
+}
+
 void jack_shutdown (void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
 	fprintf(stderr, "JACK shutdown\n");
-	abort();
+	if (!info->want_reconnect)
+		abort();
+
+	/* keep stdin open, main thread will re-connect */
+	info->can_process = 0;
+	pthread_mutex_lock(&ctrl_lock);
+	info->jack_lost = 1;
+	pthread_cond_signal(&ctrl_cond);
+	pthread_mutex_unlock(&ctrl_lock);
 }
 
-void setup_ports (int nports, char *source_names[], jack_thread_info_t *info) {
+void port_registration (jack_port_id_t id, int reg, void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	jack_port_t *port;
 	unsigned int i;
+
+	if (!reg || !(port = jack_port_by_id(info->client, id)))
+		return;
+
+	/* a destination port (re)appeared, connect it from the main thread */
+	for (i = 0; i < info->channels; i++) {
+		if (strcmp(jack_port_name(port), info->destination_names[i]))
+			continue;
+		pthread_mutex_lock(&ctrl_lock);
+		info->connect_pending = 1;
+		pthread_cond_signal(&ctrl_cond);
+		pthread_mutex_unlock(&ctrl_lock);
+		break;
+	}
+}
+
+/* port names enclosed in slashes are extended regular expressions,
+ * names containing *, ? or [ are shell glob patterns, unless a port
+ * has exactly that name, e.g. "client:out [L]" */
+static int is_port_pattern (jack_client_t *client, const char *name) {
+	const size_t len = strlen(name);
+	if (jack_port_by_name(client, name))
+		return 0;
+	if (len > 1 && name[0] == '/' && name[len - 1] == '/')
+		return 1;
+	return strpbrk(name, "*?[") != NULL;
+}
+
+/* resolve port patterns with a single jack_get_ports() call.
+ * Returns a new array of *nnames names, NULL if a pattern matches
+ * no port. If counts is given, counts[i] is set to the number of
+ * ports that names[i] expanded to. */
+char ** expand_ports (jack_client_t *client, char **names, unsigned int *nnames,
+		unsigned long flags, unsigned int *counts) {
+	const char **all = NULL;
+	char **rv;
+	unsigned int i, j, n = 0, nall = 0, max = *nnames;
+	int ok = 1;
+
+	for (i = 0; i < *nnames; ++i) {
+		if (!is_port_pattern(client, names[i]))
+			continue;
+		if (!all) {
+			all = jack_get_ports(client, NULL, JACK_DEFAULT_AUDIO_TYPE, flags);
+			while (all && all[nall])
+				++nall;
+		}
+		max += nall;
+	}
+
+	rv = (char **) malloc(max * sizeof(char *));
+	for (i = 0; ok && i < *nnames; ++i) {
+		const unsigned int first = n;
+		if (!is_port_pattern(client, names[i])) {
+			rv[n++] = strdup(names[i]);
+		} else if (names[i][0] == '/') {
+			regex_t re;
+			char *expr = strdup(names[i] + 1);
+			expr[strlen(expr) - 1] = '\0';
+			if (regcomp(&re, expr, REG_EXTENDED | REG_NOSUB)) {
+				fprintf(stderr, "invalid port pattern '%s'.\n", names[i]);
+				free(expr);
+				ok = 0;
+				break;
+			}
+			for (j = 0; j < nall; ++j) {
+				if (!regexec(&re, all[j], 0, NULL, 0))
+					rv[n++] = strdup(all[j]);
+			}
+			regfree(&re);
+			free(expr);
+		} else {
+			for (j = 0; j < nall; ++j) {
+				if (!fnmatch(names[i], all[j], 0))
+					rv[n++] = strdup(all[j]);
+			}
+		}
+		if (n == first) {
+			fprintf(stderr, "No port matches '%s'.\n", names[i]);
+			ok = 0;
+		} else if (counts) {
+			counts[i] = n - first;
+		}
+	}
+	if (all)
+		jack_free(all);
+
+	if (!ok) {
+		for (i = 0; i < n; ++i)
+			free(rv[i]);
+		free(rv);
+		return NULL;
+	}
+	*nnames = n;
+	return rv;
+}
+
+void setup_buffers (int nports, jack_thread_info_t *info) {
 	const size_t in_size =  nports * sizeof(jack_default_audio_sample_t *);
 
 	/* Allocate data structures that depend on the number of ports. */
 	ports = (jack_port_t **) malloc(sizeof(jack_port_t *) * nports);
 	out = (jack_default_audio_sample_t **) malloc(in_size);
-	rb = jack_ringbuffer_create(nports * SAMPLESIZE * info->rb_size);
+	rb = jack_ringbuffer_create(info->inputs * SAMPLESIZE * info->rb_size);
+	frame = (char *) calloc(info->inputs, SAMPLESIZE);
+	if (info->matrix) {
+		unsigned int chn;
+		mix = (jack_default_audio_sample_t **) malloc(info->inputs * sizeof(jack_default_audio_sample_t *));
+		for (chn = 0; chn < info->inputs; ++chn) {
+			mix[chn] = (jack_default_audio_sample_t *) malloc(MIX_BLOCK * sizeof(jack_default_audio_sample_t));
+			memset(mix[chn], 0, MIX_BLOCK * sizeof(jack_default_audio_sample_t));
+		}
+	}
 
 	/* When JACK is running realtime, jack_activate() will have
 	 * called mlockall() to lock our pages into memory.  But, we
@@ -269,6 +899,31 @@ void setup_ports (int nports, char *source_names[], jack_thread_info_t *info) {
 	 * create a delay that would force JACK to shut us down. */
 	memset(out, 0, in_size);
 	memset(rb->buf, 0, rb->size);
+}
+
+void connect_ports (jack_thread_info_t *info, int verbose) {
+	unsigned int i;
+
+	for (i = 0; i < info->channels; i++) {
+		if (jack_port_connected_to(ports[i], info->destination_names[i]))
+			continue;
+		/* on re-connect, silently skip destinations that do not exist (yet) */
+		if (!verbose && !jack_port_by_name(info->client, info->destination_names[i]))
+			continue;
+		if (jack_connect(info->client, jack_port_name(ports[i]), info->destination_names[i])) {
+			fprintf(stderr, "cannot connect input port %s to %s\n", jack_port_name(ports[i]), info->destination_names[i]);
+#if 0 /* not fatal - connect manually */
+			jack_client_close(info->client);
+			exit(1);
+#endif
+		} else if (!verbose && !want_quiet) {
+			fprintf(stderr, "connected output port %s to %s\n", jack_port_name(ports[i]), info->destination_names[i]);
+		}
+	}
+}
+
+int setup_ports (int nports, jack_thread_info_t *info) {
+	unsigned int i;
 
 	for (i = 0; i < nports; i++) {
 		char name[64];
@@ -277,23 +932,279 @@ void setup_ports (int nports, char *source_names[], jack_thread_info_t *info) {
 
 		if ((ports[i] = jack_port_register(info->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0)) == 0) {
 			fprintf(stderr, "cannot register input port \"%s\"!\n", name);
-			jack_client_close(info->client);
-			exit(1);
+			return -1;
 		}
 	}
+	return 0;
+}
 
-	for (i = 0; i < nports; i++) {
-		if (jack_connect(info->client, jack_port_name(ports[i]), source_names[i])) {
-			fprintf(stderr, "cannot connect input port %s to %s\n", jack_port_name(ports[i]), source_names[i]);
-#if 0 /* not fatal - connect manually */
-			jack_client_close(info->client);
-			exit(1);
-#endif
-		}
+/* connect to the JACK server, without activating the client */
+int open_client (jack_thread_info_t *info) {
+	jack_client_t *client;
+	jack_status_t jstat;
+
+	if ((client = jack_client_open(info->client_name, JackNoStartServer, &jstat)) == 0) {
+		return -1;
+	}
+
+	info->client = client;
+	info->can_process = 0;
+	info->period = jack_get_buffer_size(client);
+
+	if (info->samplerate == 0) {
+		info->samplerate = jack_get_sample_rate(client);
+	} else if (info->samplerate != jack_get_sample_rate(client)) {
+		fprintf(stderr, "Warning: JACK sample-rate changed from %d to %d\n",
+				info->samplerate, jack_get_sample_rate(client));
+	}
+	return 0;
+}
+
+int open_jack (jack_thread_info_t *info) {
+	jack_client_t *client;
+
+	/* main() opens the client early, to resolve port patterns */
+	if (!info->client && open_client(info)) {
+		return -1;
+	}
+	client = info->client;
+
+	/* bail out if buffer is smaller than twice the jack period */
+	if ((info->rb_size>>1) < jack_get_buffer_size(client)) {
+		fprintf(stderr, "Ringbuffer size needs to be at least twice jack period size\n");
+		jack_client_close(client);
+		info->client = NULL;
+		return -2;
 	}
 
+	/* when using small buffers: check if pre-buffer is not too large */
+	if ( info->rb_size - ceil(info->rb_size * info->prebuffer /100.0)
+			< jack_get_buffer_size(client)
+		 ) {
+		fprintf(stderr, "Prebuffer ratio is too high. It will never finish.\n");
+		jack_client_close(client);
+		info->client = NULL;
+		return -2;
+	}
+
+	jack_set_process_callback(client, process, info);
+	jack_set_port_registration_callback(client, port_registration, info);
+	jack_set_freewheel_callback(client, jack_freewheel, info);
+	jack_set_latency_callback(client, jack_latency, info);
+	jack_on_shutdown(client, jack_shutdown, info);
+
+	/* register all ports before activation, so that the graph is only
+	 * re-ordered once. Connections require an active client. */
+	if (setup_ports(info->channels, info)) {
+		jack_client_close(client);
+		info->client = NULL;
+		return -2;
+	}
+
+	if (jack_activate(client)) {
+		fprintf(stderr, "cannot activate client");
+	}
+
+	connect_ports(info, 1);
+
 	/* process() can start, now */
 	info->can_process = 1;
+	jack_recompute_total_latencies(client);
+	return 0;
+}
+
+void reopen_jack (jack_thread_info_t *info) {
+	jack_client_close(info->client);
+	info->client = NULL;
+
+	while (run && !info->io_done) {
+		if (!want_quiet)
+			fprintf(stderr, "trying to re-connect to JACK..\n");
+		switch (open_jack(info)) {
+			case 0:
+				if (!want_quiet)
+					fprintf(stderr, "re-connected to JACK.\n");
+				return;
+			case -2:
+				/* fatal, e.g. ringbuffer too small for new period-size */
+				run = 0;
+				wake_io();
+				return;
+			default:
+				break;
+		}
+		sleep(1);
+	}
+}
+
+static int cmp_cell (const void *a, const void *b) {
+	const matrix_cell_t *ca = (const matrix_cell_t *) a;
+	const matrix_cell_t *cb = (const matrix_cell_t *) b;
+	if (ca->out != cb->out)
+		return ca->out < cb->out ? -1 : 1;
+	return ca->in < cb->in ? -1 : (ca->in > cb->in);
+}
+
+/* parse "out=in[*gain][+in[*gain]...][,out=...]", channels count from 1,
+ * the gain is a factor or given in dB, e.g. "3=1*-3dB+2*-3dB".
+ * Returns the number of output channels, or 0 on error. */
+unsigned int parse_matrix (const char *spec, matrix_cell_t **matrix, unsigned int *ncells) {
+	const char *p = spec;
+	char *end;
+	unsigned int n = 0;
+	unsigned int outputs = 0;
+	matrix_cell_t *cells = (matrix_cell_t *) malloc((strlen(spec) / 2 + 1) * sizeof(matrix_cell_t));
+
+	while (*p) {
+		const unsigned long out = strtoul(p, &end, 10);
+		if (end == p || *end != '=' || out < 1 || out > 1024)
+			goto fail;
+		p = end + 1;
+		for (;;) {
+			const unsigned long in = strtoul(p, &end, 10);
+			float gain = 1.f;
+			if (end == p || in < 1 || in > 1024)
+				goto fail;
+			p = end;
+			if (*p == '*') {
+				gain = strtof(p + 1, &end);
+				if (end == p + 1)
+					goto fail;
+				p = end;
+				if (!strncmp(p, "dB", 2)) {
+					gain = powf(10.f, .05f * gain);
+					p += 2;
+				}
+			}
+			cells[n].out = out - 1;
+			cells[n].in = in - 1;
+			cells[n].gain = gain;
+			++n;
+			if (out > outputs)
+				outputs = out;
+			if (*p != '+')
+				break;
+			++p;
+		}
+		if (*p == ',')
+			++p;
+		else if (*p)
+			goto fail;
+	}
+	if (n == 0)
+		goto fail;
+
+	qsort(cells, n, sizeof(matrix_cell_t), cmp_cell);
+	*matrix = cells;
+	*ncells = n;
+	return outputs;
+
+fail:
+	free(cells);
+	return 0;
+}
+
+#ifdef __linux__
+/* parse a list of CPUs, e.g. "0,2-3". returns 0 on success */
+int parse_cpus (const char *list, cpu_set_t *set) {
+	const char *p = list;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*p) {
+		unsigned long first, last;
+		first = last = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+		p = end;
+		if (*p == '-') {
+			last = strtoul(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				return -1;
+			p = end;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+		if (*p == ',')
+			++p;
+		else if (*p)
+			return -1;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+#endif
+
+/* apply CPU affinity, scheduling and memory locking to the io thread.
+ * Failures are not fatal, the settings that took effect are reported. */
+void setup_io_thread (jack_thread_info_t *info) {
+	struct sched_param param;
+	int policy, rv;
+	int locked = 0;
+
+	if (info->io_cpus) {
+#ifdef __linux__
+		cpu_set_t set;
+		parse_cpus(info->io_cpus, &set);
+		if ((rv = pthread_setaffinity_np(info->thread_id, sizeof(set), &set)))
+			fprintf(stderr, "Warning: can not set io thread CPU affinity: %s\n", strerror(rv));
+#else
+		fprintf(stderr, "Warning: CPU affinity is not supported on this platform.\n");
+#endif
+	}
+
+	if (info->io_priority != 0) {
+		int prio = info->io_priority;
+		if (prio < 0) {
+			/* relative to the JACK process thread */
+			const int jack_prio = jack_client_real_time_priority(info->client);
+			if (jack_prio < 0) {
+				fprintf(stderr, "Warning: JACK is not running realtime, io thread priority is unchanged.\n");
+				prio = 0;
+			} else {
+				prio += jack_prio;
+			}
+		}
+		if (prio > 0) {
+			if (prio < sched_get_priority_min(info->io_policy))
+				prio = sched_get_priority_min(info->io_policy);
+			if (prio > sched_get_priority_max(info->io_policy))
+				prio = sched_get_priority_max(info->io_policy);
+			param.sched_priority = prio;
+			if ((rv = pthread_setschedparam(info->thread_id, info->io_policy, &param)))
+				fprintf(stderr, "Warning: can not set io thread priority: %s\n", strerror(rv));
+		}
+	}
+
+	if (info->want_mlock) {
+		/* MCL_CURRENT also faults in all stacks and buffers allocated so far */
+		if (mlockall(MCL_CURRENT | MCL_FUTURE))
+			fprintf(stderr, "Warning: can not lock memory: %s\n", strerror(errno));
+		else
+			locked = 1;
+	}
+
+	if (want_quiet)
+		return;
+	if (pthread_getschedparam(info->thread_id, &policy, &param))
+		policy = SCHED_OTHER;
+	fprintf(stderr, "io thread: %s", policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER");
+	if (policy == SCHED_FIFO || policy == SCHED_RR)
+		fprintf(stderr, " priority %d", param.sched_priority);
+#ifdef __linux__
+	if (info->io_cpus) {
+		cpu_set_t set;
+		if (pthread_getaffinity_np(info->thread_id, sizeof(set), &set) == 0) {
+			int cpu, sep = 0;
+			fprintf(stderr, ", CPUs");
+			for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				if (CPU_ISSET(cpu, &set))
+					fprintf(stderr, "%c%d", sep++ ? ',' : ' ', cpu);
+		}
+	}
+#endif
+	fprintf(stderr, "%s.\n", locked ? ", memory locked" : "");
 }
 
 void catchsig (int sig) {
@@ -305,9 +1216,7 @@ void catchsig (int sig) {
 		fprintf(stderr,"\n jack-stdin: CAUGHT SIGNAL - shutting down.\n");
 	run=0;
 	/* signal reader thread */
-	pthread_mutex_lock(&io_thread_lock);
-	pthread_cond_signal(&data_ready);
-	pthread_mutex_unlock(&io_thread_lock);
+	wake_io();
 }
 
 
@@ -321,47 +1230,77 @@ static void usage (const char *name, int status) {
 	  " -h, --help               print this message\n"
 	  " -q, --quiet              inhibit usual output\n"
 	  " -b, --bitdepth {bits}    choose integer bit depth: 16, 24 (default: 16)\n"
-	  " -d, --duration {sec}     terminate after given time, <1: unlimited (default:0)\n"
+	  " -c, --frames {n}         terminate after given number of frames\n"
+	  " -C, --channels {n}       interleaved channels in the input\n"
+		"                          (default: one per port, or the matrix inputs)\n"
+	  " -d, --duration {sec}     terminate after given time, may be fractional,\n"
+		"                          <=0: unlimited (default:0)\n"
 	  " -e, --encoding {format}  set output format: (default: signed)\n"
 		"                          signed-integer, unsigned-integer, float\n"
-	  " -f, --file {filename}    read data from file instead of stdin\n"
+	  " -f, --file {filename}    read data from file instead of stdin, if given\n"
+		"                          multiple times, files are played back to back\n"
+	  " -l, --playlist {file}    read further file-names (one per line) from\n"
+		"                          given file or FIFO, after all --file files\n"
+	  " -m, --matrix {spec}      route and mix input channels to the ports,\n"
+		"                          spec: port=in[*gain][+in[*gain]..],..\n"
+		"                          e.g. \"1=1+3*-3dB,2=2+3*-3dB\"\n"
 	  " -n, --name {clientname}  set client name in JACK instead of jstdin\n"
 	  " -p, --prebuffer {pct}    Pre-fill the buffer before starting audio output\n"
 		"                          to JACK (default 50.0%%).\n"
+	  " -k, --low-latency        only buffer up to the pre-buffer level and keep\n"
+		"                          input pipes small, to bound the latency\n"
+	  " -R, --reconnect          keep running and re-connect if JACK shuts down\n"
+	  " -a, --affinity {cpus}    run the io thread on given CPUs, e.g. 0,2-3\n"
+	  " -M, --mlock              lock all memory, avoid page-faults\n"
+	  " -P, --io-priority {prio} run the io thread with SCHED_FIFO priority,\n"
+		"                          <0: relative to JACK (e.g. -1), rr:{prio}\n"
+		"                          for SCHED_RR (default: 0, not realtime)\n"
 	  " -L, --little-endian      write little-endian integers or\n"
 		"                          native-byte-order floats (default)\n"
 	  " -B, --big-endian         write big-endian integers or swapped-order floats\n"
 	  " -S, --bufsize {samples}  set buffer size (default: 64k)\n"
+	  "Ports may be given as shell patterns, e.g. \"system:playback_*\", or as\n"
+	  "extended regular expressions in slashes, e.g. \"/playback_[12]$/\".\n"
 		);
 	exit(status);
 }
 
 int main (int argc, char **argv) {
-	jack_client_t *client;
 	jack_thread_info_t thread_info;
 	jack_thread_info_t *info = &thread_info;
-	jack_status_t jstat;
 	int c;
-	char *infn = NULL;
-	char *client_name = "jstdin";
+	char *playlist = NULL;
 
 	memset(&thread_info, 0, sizeof(thread_info));
+	clock_gettime(CLOCK_MONOTONIC, &thread_info.start_mono);
 	thread_info.rb_size = 16384 * 4;
 	thread_info.channels = 2;
 	thread_info.duration = 0;
 	thread_info.format = 0;
 	thread_info.prebuffer = 50.0;
-	thread_info.readfd = fileno(stdin);
+	thread_info.readfd = -1;
+	thread_info.playlistfd = -1;
+	thread_info.files = (char **) calloc(argc, sizeof(char *));
+	thread_info.client_name = "jstdin";
 
-	const char *optstring = "d:e:b:S:f:p:n:BLhq";
+	const char *optstring = "a:c:C:d:e:b:S:f:l:m:p:n:P:BkLMRhq";
 	struct option long_options[] = {
 		{ "help", 0, 0, 'h' },
 		{ "quiet", 0, 0, 'q' },
 		{ "duration", 1, 0, 'd' },
+		{ "frames", 1, 0, 'c' },
+		{ "channels", 1, 0, 'C' },
 		{ "encoding", 1, 0, 'e' },
 		{ "file", 1, 0, 'f' },
+		{ "playlist", 1, 0, 'l' },
+		{ "matrix", 1, 0, 'm' },
 		{ "name", 1, 0, 'n' },
 		{ "prebuffer", 1, 0, 'p' },
+		{ "reconnect", 0, 0, 'R' },
+		{ "affinity", 1, 0, 'a' },
+		{ "mlock", 0, 0, 'M' },
+		{ "low-latency", 0, 0, 'k' },
+		{ "io-priority", 1, 0, 'P' },
 		{ "little-endian", 0, 0, 'L' },
 		{ "big-endian", 0, 0, 'B' },
 		{ "bitdepth", 1, 0, 'b' },
@@ -378,14 +1317,65 @@ int main (int argc, char **argv) {
 				want_quiet = 1;
 				break;
 			case 'f':
-				free(infn);
-				infn=strdup(optarg);
+				thread_info.files[thread_info.nfiles++] = optarg;
+				break;
+			case 'l':
+				playlist = optarg;
+				break;
+			case 'm':
+				free(thread_info.matrix);
+				thread_info.matrix = NULL;
+				if (!parse_matrix(optarg, &thread_info.matrix, &thread_info.ncells)) {
+					fprintf(stderr, "invalid matrix '%s'.\n", optarg);
+					usage(argv[0], 1);
+				}
 				break;
 			case 'n':
-				client_name = optarg;
+				thread_info.client_name = optarg;
+				break;
+			case 'R':
+				thread_info.want_reconnect = 1;
+				break;
+			case 'a':
+#ifdef __linux__
+				{
+					cpu_set_t set;
+					if (parse_cpus(optarg, &set)) {
+						fprintf(stderr, "invalid CPU list.\n");
+						usage(argv[0], 1);
+					}
+				}
+#endif
+				thread_info.io_cpus = optarg;
+				break;
+			case 'M':
+				thread_info.want_mlock = 1;
+				break;
+			case 'k':
+				thread_info.low_latency = 1;
+				break;
+			case 'P':
+				thread_info.io_policy = SCHED_FIFO;
+				if (!strncmp(optarg, "rr:", 3)) {
+					thread_info.io_policy = SCHED_RR;
+					optarg += 3;
+				}
+				thread_info.io_priority = atoi(optarg);
 				break;
 			case 'd':
-				thread_info.duration = atoi(optarg);
+				thread_info.seconds = atof(optarg);
+				thread_info.duration = 0;
+				break;
+			case 'c':
+				thread_info.duration = strtoull(optarg, NULL, 10);
+				thread_info.seconds = 0;
+				break;
+			case 'C':
+				if (atoi(optarg) <= 0) {
+					fprintf(stderr, "invalid number of channels.\n");
+					usage(argv[0], 1);
+				}
+				thread_info.inputs = atoi(optarg);
 				break;
 			case 'p':
 				thread_info.prebuffer = atof(optarg);
@@ -445,55 +1435,115 @@ int main (int argc, char **argv) {
 		usage(argv[0], 1);
 	}
 
-	if (infn) {
-		thread_info.readfd = open(infn, O_RDONLY) ;
-		if (thread_info.readfd <0) {
+	if (playlist) {
+		struct stat st;
+		/* keep a fifo open for writing, so that it never reaches EOF */
+		if (stat(playlist, &st) == 0 && S_ISFIFO(st.st_mode))
+			thread_info.playlistfd = open(playlist, O_RDWR | O_NONBLOCK);
+		else
+			thread_info.playlistfd = open(playlist, O_RDONLY | O_NONBLOCK);
+		if (thread_info.playlistfd < 0) {
+			fprintf(stderr, "Can not open playlist.\n");
+			exit(1);
+		}
+	}
+
+	if (thread_info.nfiles > 0) {
+		if (open_next(&thread_info)) {
 			fprintf(stderr, "Can not open file.\n");
 			exit(1);
 		}
+	} else if (!playlist) {
+		/* the io thread waits for input with poll() */
+		thread_info.readfd = fileno(stdin);
+		thread_info.readflags = fcntl(thread_info.readfd, F_GETFL);
+		fcntl(thread_info.readfd, F_SETFL, thread_info.readflags | O_NONBLOCK);
+		input_opened(&thread_info);
 	}
 
-	/* set up JACK client */
-	if ((client = jack_client_open(client_name, JackNoStartServer, &jstat)) == 0) {
-		fprintf(stderr, "Can not connect to JACK.\n");
+	if (pipe(wake_pipe)) {
+		fprintf(stderr, "Can not create pipe: %s\n", strerror(errno));
 		exit(1);
 	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
 
-	thread_info.client = client;
-	thread_info.can_process = 0;
-	thread_info.channels = argc - optind;
-
-	if (thread_info.duration > 0) {
-		thread_info.duration *= jack_get_sample_rate(thread_info.client);
+	/* connect to JACK early, port patterns are resolved against its ports */
+	if (open_client(&thread_info)) {
+		fprintf(stderr, "Can not connect to JACK.\n");
+		exit(1);
 	}
 
-	/* bail out if buffer is smaller than twice the jack period */
-	if ((thread_info.rb_size>>1) < jack_get_buffer_size(thread_info.client)) {
-		fprintf(stderr, "Ringbuffer size needs to be at least twice jack period size\n");
+	thread_info.channels = argc - optind;
+	thread_info.destination_names = expand_ports(thread_info.client, &argv[optind],
+			&thread_info.channels, JackPortIsInput, NULL);
+	if (!thread_info.destination_names) {
 		jack_client_close(thread_info.client);
-		usage(argv[0], 1);
+		exit(1);
 	}
-
-	/* when using small buffers: check if pre-buffer is not too large */
-	if ( thread_info.rb_size - ceil(thread_info.rb_size * thread_info.prebuffer /100.0)
-			< jack_get_buffer_size(thread_info.client)
-		 ) {
-		fprintf(stderr, "Prebuffer ratio is too high. It will never finish.\n");
-		jack_client_close(thread_info.client);
-		usage(argv[0], 1);
+	if (!thread_info.matrix && thread_info.inputs && thread_info.inputs != thread_info.channels) {
+		unsigned int i;
+		/* channel n goes to port n, surplus channels are dropped,
+		 * surplus ports are silent */
+		thread_info.ncells = thread_info.inputs < thread_info.channels ? thread_info.inputs : thread_info.channels;
+		thread_info.matrix = (matrix_cell_t *) malloc(thread_info.ncells * sizeof(matrix_cell_t));
+		for (i = 0; i < thread_info.ncells; ++i) {
+			thread_info.matrix[i].out = i;
+			thread_info.matrix[i].in = i;
+			thread_info.matrix[i].gain = 1.f;
+		}
+	}
+	if (thread_info.matrix) {
+		unsigned int i, used = 0;
+		for (i = 0; i < thread_info.ncells; ++i) {
+			if (thread_info.matrix[i].in >= used)
+				used = thread_info.matrix[i].in + 1;
+		}
+		if (!thread_info.inputs) {
+			/* without --channels, the input has as many channels as the matrix uses */
+			thread_info.inputs = used;
+		} else if (used > thread_info.inputs) {
+			fprintf(stderr, "Matrix input %u does not exist, there are %u channels.\n",
+					used, thread_info.inputs);
+			usage(argv[0], 1);
+		}
+		if (thread_info.matrix[thread_info.ncells - 1].out >= thread_info.channels) {
+			fprintf(stderr, "Matrix output %u does not exist, there are %u ports.\n",
+					thread_info.matrix[thread_info.ncells - 1].out + 1, thread_info.channels);
+			usage(argv[0], 1);
+		}
+	} else {
+		thread_info.inputs = thread_info.channels;
 	}
+	thread_info.decode = select_decoder(&thread_info);
+	setup_buffers(thread_info.channels, &thread_info);
 
-	jack_set_process_callback(client, process, &thread_info);
-	jack_on_shutdown(client, jack_shutdown, &thread_info);
+	/* set up JACK client */
+	switch (open_jack(&thread_info)) {
+		case 0:
+			break;
+		case -1:
+			fprintf(stderr, "Can not connect to JACK.\n");
+			exit(1);
+		default:
+			usage(argv[0], 1);
+	}
 
-	if (jack_activate(client)) {
-		fprintf(stderr, "cannot activate client");
+	if (thread_info.seconds > 0) {
+		thread_info.duration = llrint(thread_info.seconds * thread_info.samplerate);
 	}
 
-	setup_ports(thread_info.channels, &argv[optind], &thread_info);
+	if (thread_info.low_latency) {
+		/* only buffer the pre-buffer, but at least two periods */
+		jack_nframes_t frames = ceil(thread_info.rb_size * thread_info.prebuffer / 100.0);
+		if (frames < 2 * thread_info.period)
+			frames = 2 * thread_info.period;
+		thread_info.max_fill = frames * thread_info.inputs * SAMPLESIZE;
+	}
 
 	/* set up i/o thread */
 	pthread_create(&thread_info.thread_id, NULL, io_thread, &thread_info);
+	setup_io_thread(&thread_info);
 #ifndef _WIN32
 	signal(SIGHUP, catchsig);
 	signal(SIGINT, catchsig);
@@ -501,35 +1551,81 @@ int main (int argc, char **argv) {
 
 	if (!want_quiet) {
 		fprintf(stderr, "%i channel%s, %s %sbit %s%s %s @%iSPS.\n",
-			thread_info.channels,
-			(thread_info.channels>1)?"s":"",
-			(thread_info.channels>1)?"interleaved":"",
+			thread_info.inputs,
+			(thread_info.inputs>1)?"s":"",
+			(thread_info.inputs>1)?"interleaved":"",
 			(thread_info.format&2)?(thread_info.format&1?"32":"8"):(thread_info.format&1?"24":"16"),
 			(IS_FMTFLT)?"":(IS_SIGNED?"signed-":"unsigned-"),
 			(IS_FMTFLT)?"float":"integer",
 			(IS_FMTFLT)?
 				(IS_BIGEND?"non-native-endian":"native-endian"):
 				(IS_BIGEND?"big-endian":"little-endian"),
-			jack_get_sample_rate(thread_info.client)
+			thread_info.samplerate
 		);
 	}
 
 	/* all systems go - run the i/o thread */
 	thread_info.can_capture = 1;
+
+	/* handle JACK notifications until the i/o thread terminates */
+	pthread_mutex_lock(&ctrl_lock);
+	while (!thread_info.io_done) {
+		if (thread_info.jack_lost) {
+			thread_info.jack_lost = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			reopen_jack(&thread_info);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		if (thread_info.connect_pending) {
+			thread_info.connect_pending = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			connect_ports(&thread_info, 0);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		if (thread_info.latency_pending) {
+			thread_info.latency_pending = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			if (thread_info.client && thread_info.can_process)
+				jack_recompute_total_latencies(thread_info.client);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		pthread_cond_wait(&ctrl_cond, &ctrl_lock);
+	}
+	pthread_mutex_unlock(&ctrl_lock);
 	pthread_join(thread_info.thread_id, NULL);
 
 	/* end - clean up */
+	if (thread_info.nfiles == 0 && !playlist) {
+		fcntl(fileno(stdin), F_SETFL, thread_info.readflags);
+	}
 
-	if (infn) {
-		/* close readfd if it is not stdin*/
-	  close(thread_info.readfd);
-		free(infn);
+	if (thread_info.readfd >= 0) {
+		close_input(&thread_info);
 	}
-	
-	if (underruns > 0 && !want_quiet) {
-		fprintf(stderr, "Note: there were %ld buffer underruns.\n", underruns);
+	if (thread_info.playlistfd >= 0) {
+		close(thread_info.playlistfd);
 	}
-	jack_client_close(client);
+	free(thread_info.files);
+	for (c = 0; c < thread_info.channels; ++c)
+		free(thread_info.destination_names[c]);
+	free(thread_info.destination_names);
+
+	if (atomic_load(&underruns) > 0 && !want_quiet) {
+		fprintf(stderr, "Note: there were %ld buffer underruns.\n", atomic_load(&underruns));
+	}
+	if (thread_info.client)
+		jack_client_close(thread_info.client);
 	jack_ringbuffer_free(rb);
+	free(frame);
+	if (thread_info.matrix) {
+		unsigned int chn;
+		for (chn = 0; chn < thread_info.inputs; ++chn)
+			free(mix[chn]);
+		free(mix);
+		free(thread_info.matrix);
+	}
 	return(0);
 }
@@ -33,28 +33,139 @@
  *   > /tmp/my.ogg
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* vmsplice, F_SETPIPE_SZ, pthread_setaffinity_np */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <getopt.h>
 #include <signal.h>
 #include <math.h>
 #include <errno.h>
+#include <time.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
+#if defined __linux__ && defined SPLICE_F_NONBLOCK
+#include <sys/uio.h>
+#define HAVE_VMSPLICE
+#endif
+
+/** dither and noise-shaping state of one output channel */
+typedef struct _dither {
+	uint32_t rnd;          /* xorshift PRNG state, never 0 */
+	float e1, e2;          /* previous quantization errors, in LSB */
+} dither_t;
+
+/** convert nframes of non-interleaved float to interleaved output samples */
+typedef void (*encode_t) (char *dst, jack_default_audio_sample_t **src, dither_t *dither,
+		unsigned int channels, jack_nframes_t offset, jack_nframes_t nframes);
+
+/** one coefficient of a sparse mixing matrix */
+typedef struct _matrix_cell {
+	unsigned int out;      /* output channel, 0-based */
+	unsigned int in;       /* input port, 0-based */
+	float gain;
+} matrix_cell_t;
+
+/** a group of ports written interleaved to one file */
+typedef struct _stream {
+	struct _thread_info *info;
+	const char *path;
+	int fd;
+	int fdflags;           /* original file status flags */
+	int sparse;            /* regular file, skip blocks of silence */
+	int fifo;              /* output is a pipe */
+	unsigned int first;    /* index of first port */
+	unsigned int channels;
+	matrix_cell_t *matrix; /* routing/mixing, sorted by output, or NULL */
+	unsigned int ncells;
+	jack_default_audio_sample_t **mix;  /* mixed output channels */
+	jack_default_audio_sample_t **src;  /* per output: mix or an input port */
+	dither_t *dither;      /* per output channel */
+	jack_ringbuffer_t *rb;
+	char *frame;           /* a frame that wraps around the end of rb */
+	uint64_t total_captured;
+	size_t partial;        /* bytes of an incomplete frame already written */
+	int splice;            /* output is a pipe, use vmsplice() */
+	size_t inflight;       /* bytes spliced into the pipe but not yet read */
+	int rotate;            /* output is split into multiple files */
+	int wait_next;         /* at file boundary, next file is not open, yet */
+	int next_fd;           /* next file, opened ahead of time, or -1 */
+	char *cur_path;        /* current file, renamed once its start-time is known */
+	char *next_path;
+	unsigned int cur_index;
+	unsigned int next_index;
+	unsigned int files_opened;
+	double file_start;     /* wall-clock time of the file's first frame, 0: not started */
+	time_t boundary;       /* wall-clock time at which the current file ends */
+	int name_pending;      /* file_start was set, the main thread may rename the file */
+	uint64_t file_frames;  /* frames written to the current file */
+	uint64_t file_length;  /* frames to write to the current file */
+	int done;
+} jack_stream_t;
+
 typedef struct _thread_info {
 	pthread_t thread_id;
 	pthread_t mesg_thread_id;
-	jack_nframes_t duration;
+	uint64_t duration;      /* frames, 0: unlimited */
+	double seconds;         /* --duration, converted once the sample-rate is known */
 	jack_nframes_t rb_size;
 	jack_client_t *client;
 	unsigned int channels;
 	volatile int can_capture;
 	volatile int can_process;
+	volatile int jack_lost;
+	volatile int connect_pending;
+	volatile int io_done;
+	volatile int rotate_pending;
+	volatile int freewheeling;
+	volatile int io_wait;   /* process() is blocked waiting for the io thread */
+	unsigned int nstreams;
+	jack_stream_t *streams;
+	int want_reconnect;
+	int io_policy;          /* scheduling class of the io thread */
+	int io_priority;        /* >0: absolute, <0: relative to JACK, 0: unchanged */
+	const char *io_cpus;    /* CPU affinity of the io thread, or NULL */
+	int want_mlock;
+	int low_latency;
+	jack_nframes_t period;
+	volatile jack_nframes_t latency;  /* published latency of the ports */
+	volatile int latency_pending;
+	jack_nframes_t latency_peak;     /* highest latency in the current window */
+	struct timespec latency_window;   /* start of the current window */
+	unsigned int rotate_interval;  /* seconds, aligned to wall-clock */
+	uint64_t rotate_length;        /* frames, 0: no rotation */
+	struct timespec start_time;
+	time_t rotate_boundary;        /* first wall-clock boundary after start_time */
+	jack_nframes_t samplerate;
+	const char *client_name;
+	char **source_names;
+	struct timespec start_mono;  /* startup, to measure the time to the first sample */
+	struct timespec first_time;
+	atomic_int first_sample;     /* 1: process() handled the first samples, 2: reported */
 	int format;
+	int dither;             /* 0: off, 1: TPDF, 2, 3: 1st, 2nd order noise-shaped */
+	encode_t encode;
+	encode_t encode_silence; /* without dither, for gated periods */
+	float gate;             /* peak below which a period is silenced, 0: off */
+	int want_sparse;
+	int want_splice;        /* vmsplice() to pipes, the reader must copy the data */
 	/**format:
 	 * bit0,1: 16/24/8/32(float)
 	 * bit8:   signed/unsiged (0x10)
@@ -65,131 +176,741 @@ typedef struct _thread_info {
 
 #define IS_FMTFLT ((info->format&0x20))
 #define IS_BIGEND (info->format&0x40)
-#define IS_FMT32B ((info->format&0x23)==3)
-#define IS_FMT08B ((info->format&3)==2)
-#define IS_FMT24B ((info->format&3)==1)
-#define IS_FMT16B ((info->format&3)==0)
 #define IS_SIGNED (!(info->format&0x10))
 
 #define SAMPLESIZE ((info->format&2)?((info->format&1)?4:1):((info->format&1)?3:2))
-#define POWHX ((info->format&2)?((info->format&1)?2147483647:127):((info->format&1)? 8388607:32767))
-#define POWHS ((info->format&2)?((info->format&1)?2147483648.0:128.0):((info->format&1)? 8388608.0:32768.0))
 
-#define FMTOFF ((IS_SIGNED)?0.0:POWHX)
-#define FMTMLT (POWHS)
+/* triangular PDF noise in the range -1..+1 LSB */
+static inline float tpdf (uint32_t *rnd) {
+	uint32_t x = *rnd;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*rnd = x;
+	return ((float) (x & 0xffff) - (float) (x >> 16)) * (1.f / 65536.f);
+}
+
+/* Sample conversion is specialized at compile-time for every output
+ * format, so that the inner loop has no per-sample format decisions.
+ * Unsigned integers are offset by 2^(bits-1), as jack-stdin and sox expect.
+ *
+ * SHAPE < 0 quantizes without dither. Otherwise TPDF dither is added and
+ * the quantization error is fed back with a 1st (SHAPE 1: 1 - z^-1) or
+ * 2nd (SHAPE 2: (1 - z^-1)^2) order high-pass, dithered output is clipped. */
+#define ENCODE_INT(NAME, BYTES, UNSIGNED, BIGEND, SHAPE) \
+static void NAME (char *dst, jack_default_audio_sample_t **src, dither_t *dither, \
+		unsigned int channels, jack_nframes_t offset, jack_nframes_t nframes) { \
+	const float mult = (float) (1U << (8 * BYTES - 1)); \
+	const float peak = (float) ((1U << (8 * BYTES - 1)) - 1); \
+	const uint32_t off = UNSIGNED ? 1U << (8 * BYTES - 1) : 0; \
+	unsigned char *bytes = (unsigned char *) dst; \
+	jack_nframes_t i; \
+	unsigned int chn, b; \
+	for (i = offset; i < offset + nframes; ++i) { \
+		for (chn = 0; chn < channels; ++chn) { \
+			float v = src[chn][i] * mult; \
+			uint32_t d; \
+			if (SHAPE < 0) { \
+				d = (uint32_t) (int32_t) rintf(v) + off; \
+			} else { \
+				dither_t *ds = &dither[chn]; \
+				float q; \
+				if (SHAPE == 1) \
+					v -= ds->e1; \
+				if (SHAPE == 2) \
+					v -= 2.f * ds->e1 - ds->e2; \
+				q = rintf(v + tpdf(&ds->rnd)); \
+				if (SHAPE > 0) { \
+					ds->e2 = ds->e1; \
+					ds->e1 = q - v; \
+				} \
+				q = q > peak ? peak : (q < -mult ? -mult : q); \
+				d = (uint32_t) (int32_t) q + off; \
+			} \
+			for (b = 0; b < BYTES; ++b) \
+				bytes[BIGEND ? BYTES - 1 - b : b] = (unsigned char) ((d >> (8 * b)) & 0xff); \
+			bytes += BYTES; \
+		} \
+	} \
+}
+
+#define ENCODE_DITHER(NAME, BYTES, UNSIGNED, BIGEND) \
+	ENCODE_INT(NAME,         BYTES, UNSIGNED, BIGEND, -1) \
+	ENCODE_INT(NAME ## _tpdf, BYTES, UNSIGNED, BIGEND, 0) \
+	ENCODE_INT(NAME ## _ns1,  BYTES, UNSIGNED, BIGEND, 1) \
+	ENCODE_INT(NAME ## _ns2,  BYTES, UNSIGNED, BIGEND, 2)
+
+ENCODE_DITHER(encode_s8,     1, 0, 0)
+ENCODE_DITHER(encode_u8,     1, 1, 0)
+ENCODE_DITHER(encode_s16le,  2, 0, 0)
+ENCODE_DITHER(encode_u16le,  2, 1, 0)
+ENCODE_DITHER(encode_s16be,  2, 0, 1)
+ENCODE_DITHER(encode_u16be,  2, 1, 1)
+ENCODE_DITHER(encode_s24le,  3, 0, 0)
+ENCODE_DITHER(encode_u24le,  3, 1, 0)
+ENCODE_DITHER(encode_s24be,  3, 0, 1)
+ENCODE_DITHER(encode_u24be,  3, 1, 1)
 
-#define BE(i) ( (IS_BIGEND)?(SAMPLESIZE-i-1):i)
+/* dither is below the resolution of float at 32 bit */
+ENCODE_INT(encode_s32le,  4, 0, 0, -1)
+ENCODE_INT(encode_u32le,  4, 1, 0, -1)
+ENCODE_INT(encode_s32be,  4, 0, 1, -1)
+ENCODE_INT(encode_u32be,  4, 1, 1, -1)
+
+static void encode_float (char *dst, jack_default_audio_sample_t **src, dither_t *dither,
+		unsigned int channels, jack_nframes_t offset, jack_nframes_t nframes) {
+	float *d = (float *) dst;
+	jack_nframes_t i;
+	unsigned int chn;
+	for (i = offset; i < offset + nframes; ++i)
+		for (chn = 0; chn < channels; ++chn)
+			*d++ = src[chn][i];
+}
+
+static void encode_float_swap (char *dst, jack_default_audio_sample_t **src, dither_t *dither,
+		unsigned int channels, jack_nframes_t offset, jack_nframes_t nframes) {
+	jack_nframes_t i;
+	unsigned int chn;
+	for (i = offset; i < offset + nframes; ++i) {
+		for (chn = 0; chn < channels; ++chn) {
+			/* swap float endianess */
+			const char *flin = (const char *) &src[chn][i];
+			dst[0] = flin[3];
+			dst[1] = flin[2];
+			dst[2] = flin[1];
+			dst[3] = flin[0];
+			dst += 4;
+		}
+	}
+}
+
+encode_t select_encoder (jack_thread_info_t *info, int dither) {
+	/* indexed by [dither][bytes - 1][unsigned][big-endian] */
+	static const encode_t encoders[4][4][2][2] = {
+		{
+			{ { encode_s8,    encode_s8    }, { encode_u8,    encode_u8    } },
+			{ { encode_s16le, encode_s16be }, { encode_u16le, encode_u16be } },
+			{ { encode_s24le, encode_s24be }, { encode_u24le, encode_u24be } },
+			{ { encode_s32le, encode_s32be }, { encode_u32le, encode_u32be } },
+		}, {
+			{ { encode_s8_tpdf,    encode_s8_tpdf    }, { encode_u8_tpdf,    encode_u8_tpdf    } },
+			{ { encode_s16le_tpdf, encode_s16be_tpdf }, { encode_u16le_tpdf, encode_u16be_tpdf } },
+			{ { encode_s24le_tpdf, encode_s24be_tpdf }, { encode_u24le_tpdf, encode_u24be_tpdf } },
+			{ { encode_s32le,      encode_s32be      }, { encode_u32le,      encode_u32be      } },
+		}, {
+			{ { encode_s8_ns1,    encode_s8_ns1    }, { encode_u8_ns1,    encode_u8_ns1    } },
+			{ { encode_s16le_ns1, encode_s16be_ns1 }, { encode_u16le_ns1, encode_u16be_ns1 } },
+			{ { encode_s24le_ns1, encode_s24be_ns1 }, { encode_u24le_ns1, encode_u24be_ns1 } },
+			{ { encode_s32le,     encode_s32be     }, { encode_u32le,     encode_u32be     } },
+		}, {
+			{ { encode_s8_ns2,    encode_s8_ns2    }, { encode_u8_ns2,    encode_u8_ns2    } },
+			{ { encode_s16le_ns2, encode_s16be_ns2 }, { encode_u16le_ns2, encode_u16be_ns2 } },
+			{ { encode_s24le_ns2, encode_s24be_ns2 }, { encode_u24le_ns2, encode_u24be_ns2 } },
+			{ { encode_s32le,     encode_s32be     }, { encode_u32le,     encode_u32be     } },
+		},
+	};
+	if (IS_FMTFLT)
+		return IS_BIGEND ? encode_float_swap : encode_float;
+	return encoders[dither][SAMPLESIZE - 1][IS_SIGNED ? 0 : 1][IS_BIGEND ? 1 : 0];
+}
+
+/* frames mixed at a time when a matrix is used */
+#define MIX_BLOCK 1024
 
 /* JACK data */
 jack_port_t **ports;
 jack_default_audio_sample_t **in;
 jack_nframes_t nframes;
 
+jack_default_audio_sample_t *silence;
+jack_default_audio_sample_t **silence_src; /* silence for every channel */
+
 /* Synchronization between process thread and disk thread. */
-jack_ringbuffer_t *rb;
-pthread_mutex_t io_thread_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  data_ready = PTHREAD_COND_INITIALIZER;
+int wake_pipe[2] = { -1, -1 };
+
+/* freewheeling: process() waits for the io thread instead of losing data */
+pthread_mutex_t io_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  io_progress_ready = PTHREAD_COND_INITIALIZER;
+unsigned long io_progress = 0;
+
+/* Synchronization between JACK notifications and the main thread. */
+pthread_mutex_t ctrl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  ctrl_cond = PTHREAD_COND_INITIALIZER;
 
 /* global options/status */
 int want_quiet = 0;
 volatile int run = 1;
-long overruns = 0;
+atomic_long overruns = 0;
 
-void * io_thread (void *arg) {
-	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+/* wake up the io thread, this is async-signal and realtime safe */
+void wake_io (void) {
+	const char c = 0;
+	if (write(wake_pipe[1], &c, 1) < 0) {
+		; /* pipe is full, io thread is awake already */
+	}
+}
+
+/* called by the io thread after moving data */
+void signal_progress (void) {
+	pthread_mutex_lock(&io_progress_lock);
+	++io_progress;
+	pthread_cond_broadcast(&io_progress_ready);
+	pthread_mutex_unlock(&io_progress_lock);
+}
+
+/* freewheeling: block process() until the io thread made progress */
+void wait_progress (jack_thread_info_t *info) {
+	pthread_mutex_lock(&io_progress_lock);
+	const unsigned long seq = io_progress;
+	info->io_wait = 1;
+	wake_io();
+	while (run && !info->io_done && seq == io_progress) {
+		pthread_cond_wait(&io_progress_ready, &io_progress_lock);
+	}
+	info->io_wait = 0;
+	pthread_mutex_unlock(&io_progress_lock);
+}
+
+#ifdef HAVE_VMSPLICE
+/* map ringbuffer pages into the output pipe instead of copying them.
+ * The pipe only references the pages (they are not gifted), and data
+ * is released from the ringbuffer once FIONREAD shows it was read.
+ * That is only safe if the reader copies the data with read(): a reader
+ * that moves the pages on with splice() drains the pipe while they are
+ * still referenced downstream. Hence this is opt-in (--zero-copy).
+ * returns -1 on error, 1 when the stream is complete, 0 otherwise */
+int splice_stream (jack_stream_t *stream) {
+	jack_thread_info_t *info = stream->info;
+	const size_t bytes_per_frame = stream->channels * SAMPLESIZE;
+	jack_ringbuffer_data_t vec[2];
+	struct iovec iov[2];
+	uint64_t left = UINT64_MAX;
+	size_t skip;
+	int queued, k, n = 0;
+	ssize_t rv;
+
+	/* release data that the reader has consumed */
+	if (ioctl(stream->fd, FIONREAD, &queued) == 0 && queued >= 0 && (size_t) queued < stream->inflight) {
+		jack_ringbuffer_read_advance(stream->rb, stream->inflight - queued);
+		stream->inflight = queued;
+	}
+
+	if (info->duration > 0) {
+		left = (info->duration - stream->total_captured) * bytes_per_frame - stream->partial;
+	}
+
+	/* skip data that is already in the pipe */
+	jack_ringbuffer_get_read_vector(stream->rb, vec);
+	skip = stream->inflight;
+	for (k = 0; k < 2 && left > 0; ++k) {
+		size_t len;
+		if (skip >= vec[k].len) {
+			skip -= vec[k].len;
+			continue;
+		}
+		len = vec[k].len - skip;
+		if (len > left) len = left;
+		iov[n].iov_base = vec[k].buf + skip;
+		iov[n].iov_len = len;
+		left -= len;
+		skip = 0;
+		++n;
+	}
+
+	while (n > 0 && (rv = vmsplice(stream->fd, iov, n, SPLICE_F_NONBLOCK)) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if ((errno == EINVAL || errno == ENOSYS) && stream->inflight == 0) {
+			/* not supported, fall back to write() */
+			stream->splice = 0;
+			return 0;
+		}
+		if (!want_quiet)
+			fprintf(stderr, "FATAL: vmsplice error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (n > 0) {
+		stream->inflight += rv;
+		stream->partial += rv;
+		stream->total_captured += stream->partial / bytes_per_frame;
+		stream->partial %= bytes_per_frame;
+	}
+
+	if (info->duration > 0 && stream->total_captured >= info->duration)
+		return 1;
+	return 0;
+}
+#endif
+
+/* bytes in the ringbuffer that were not passed on to the file, yet */
+size_t stream_pending (jack_stream_t *stream) {
+	return jack_ringbuffer_read_space(stream->rb) - stream->inflight;
+}
+
+/* nanoseconds between latency updates */
+#define LATENCY_WINDOW 1000000000L
+
+/* publish the latency: data in the ringbuffer, plus data queued in the
+ * output pipe. With several outputs, the ports report the latency of the
+ * slowest one. At most once per LATENCY_WINDOW, the highest latency seen
+ * during the window is published if it differs by a period or 10%. */
+void update_latency (jack_thread_info_t *info) {
+	jack_nframes_t latency = 0, threshold;
+	struct timespec now;
+	unsigned int s;
+
+	for (s = 0; s < info->nstreams; ++s) {
+		jack_stream_t *stream = &info->streams[s];
+		const size_t bytes_per_frame = stream->channels * SAMPLESIZE;
+		size_t bytes = stream_pending(stream);
+#ifdef FIONREAD
+		int queued;
+		if (stream->fifo && ioctl(stream->fd, FIONREAD, &queued) == 0 && queued > 0)
+			bytes += queued;
+#endif
+		if (bytes / bytes_per_frame > latency)
+			latency = bytes / bytes_per_frame;
+	}
+
+	if (latency > info->latency_peak)
+		info->latency_peak = latency;
+
+	/* the fill-level changes every period, so only the peak of each
+	 * window is considered, and only larger changes are published */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - info->latency_window.tv_sec) * 1000000000L
+			+ (now.tv_nsec - info->latency_window.tv_nsec) < LATENCY_WINDOW)
+		return;
+	threshold = info->latency / 10 > info->period ? info->latency / 10 : info->period;
+	if (info->latency_peak + threshold <= info->latency || info->latency_peak >= info->latency + threshold) {
+		pthread_mutex_lock(&ctrl_lock);
+		info->latency = info->latency_peak;
+		info->latency_pending = 1;
+		pthread_cond_signal(&ctrl_cond);
+		pthread_mutex_unlock(&ctrl_lock);
+	}
+	info->latency_window = now;
+	info->latency_peak = latency;
+}
+
+/* estimate the wall-clock time of the next frame to be written from the
+ * queued frames: process() queued the last one less than a period ago */
+static double next_frame_time (jack_stream_t *stream) {
+	jack_thread_info_t *info = stream->info;
+	const size_t bytes_per_frame = stream->channels * SAMPLESIZE;
+	const size_t queued = (stream_pending(stream) + stream->partial) / bytes_per_frame;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9 - (double) queued / info->samplerate;
+}
+
+/* a new file starts with the next frame. Note its wall-clock time and,
+ * when rotating by time, cut it at the next boundary. The length is
+ * measured for every file, so cuts do not drift with the sample-clock. */
+void start_file (jack_stream_t *stream) {
+	jack_thread_info_t *info = stream->info;
+	const double t = next_frame_time(stream);
+	time_t boundary = stream->boundary;
+	uint64_t length = info->rotate_length;
+
+	if (info->rotate_interval > 0) {
+		while (boundary <= t)
+			boundary += info->rotate_interval;
+		length = llrint((boundary - t) * info->samplerate);
+	}
+
+	pthread_mutex_lock(&ctrl_lock);
+	stream->file_start = t;
+	stream->boundary = boundary;
+	stream->file_length = length;
+	stream->name_pending = 1;
+	info->rotate_pending = 1;
+	pthread_cond_signal(&ctrl_cond);
+	pthread_mutex_unlock(&ctrl_lock);
+}
+
+/* switch to the next file, which the main thread opened in advance.
+ * returns 0 on success, -1 if the next file is not available, yet */
+int rotate_file (jack_stream_t *stream) {
+	jack_thread_info_t *info = stream->info;
+	int fd;
+
+	pthread_mutex_lock(&ctrl_lock);
+	fd = stream->next_fd;
+	if (fd >= 0) {
+		stream->next_fd = -1;
+		free(stream->cur_path);
+		stream->cur_path = stream->next_path;
+		stream->cur_index = stream->next_index;
+		stream->next_path = NULL;
+	}
+	pthread_mutex_unlock(&ctrl_lock);
+
+	if (fd < 0) {
+		/* wait for the main thread, data accumulates in the ringbuffer */
+		stream->wait_next = 1;
+		return -1;
+	}
+
+	close(stream->fd);
+	stream->fd = fd;
+	stream->wait_next = 0;
+	stream->file_frames = 0;
+	stream->boundary += info->rotate_interval;
+	start_file(stream);
+	return 0;
+}
+
+/* file-system block size, aligned blocks of zeros are not written */
+#define SPARSE_BLOCK 4096
+
+static int all_zero (const char *buf, size_t len) {
+	unsigned char acc = 0;
+	size_t i;
+	for (i = 0; i < len; ++i)
+		acc |= buf[i];
+	return acc == 0;
+}
+
+/* write to a regular file, leaving holes where the data is digital
+ * silence (zero bytes). Returns the number of bytes consumed, or -1. */
+ssize_t write_sparse (jack_stream_t *stream, const char *buf, size_t len) {
+	/* query the position, the fd may be shared with a previous file */
+	off_t offset = lseek(stream->fd, 0, SEEK_CUR);
+	size_t done = 0;
+	int hole = 0;
+
+	if (offset < 0)
+		return -1;
+
+	while (done < len) {
+		/* data up to the end of the current file-system block */
+		size_t n = SPARSE_BLOCK - (size_t) (offset % SPARSE_BLOCK);
+		int zero;
+		if (n > len - done)
+			n = len - done;
+
+		/* extend to the following blocks that are alike */
+		zero = all_zero(buf + done, n);
+		while (done + n < len) {
+			const size_t m = len - done - n < SPARSE_BLOCK ? len - done - n : SPARSE_BLOCK;
+			if (all_zero(buf + done + n, m) != zero)
+				break;
+			n += m;
+		}
+
+		if (zero) {
+			if (lseek(stream->fd, n, SEEK_CUR) < 0)
+				return done > 0 ? (ssize_t) done : -1;
+			hole = 1;
+		} else {
+			const ssize_t rv = write(stream->fd, buf + done, n);
+			if (rv < 0)
+				return done > 0 ? (ssize_t) done : -1;
+			n = rv;
+			hole = 0;
+		}
+		offset += n;
+		done += n;
+	}
+
+	/* extend the file if it ends in a hole */
+	if (hole && ftruncate(stream->fd, offset))
+		return -1;
+	return done;
+}
+
+/* write as much queued data as the file accepts without blocking.
+ * returns -1 on error, 1 when the stream is complete, 0 otherwise */
+int write_stream (jack_stream_t *stream) {
+	jack_thread_info_t *info = stream->info;
+	const size_t bytes_per_frame = stream->channels * SAMPLESIZE;
+	jack_ringbuffer_data_t vec[2];
+
+#ifdef HAVE_VMSPLICE
+	if (stream->splice)
+		return splice_stream(stream);
+#endif
+
+	if (stream->rotate && stream->file_start == 0) {
+		/* the first file starts with the first queued frame */
+		if (stream_pending(stream) == 0)
+			return 0;
+		start_file(stream);
+	}
+
+	while (1) {
+		size_t len, frames;
+		ssize_t rv;
 
-	jack_nframes_t total_captured = 0;
-	const size_t bytes_per_frame = info->channels * SAMPLESIZE;
-	void *framebuf = malloc (bytes_per_frame);
+		if (info->duration > 0 && stream->total_captured >= info->duration)
+			return 1;
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	pthread_mutex_lock(&io_thread_lock);
+		/* start a new file at the exact frame boundary */
+		if (stream->rotate && stream->file_frames >= stream->file_length) {
+			if (rotate_file(stream))
+				return 0;
+		}
+
+		jack_ringbuffer_get_read_vector(stream->rb, vec);
+		len = vec[0].len;
+		if (len == 0)
+			return 0;
+
+		if (info->duration > 0) {
+			const uint64_t left = (info->duration - stream->total_captured) * bytes_per_frame - stream->partial;
+			if (len > left) len = left;
+		}
+		if (stream->rotate) {
+			const uint64_t left = (stream->file_length - stream->file_frames) * bytes_per_frame - stream->partial;
+			if (len > left) len = left;
+		}
+
+		if (stream->sparse)
+			rv = write_sparse(stream, vec[0].buf, len);
+		else
+			rv = write(stream->fd, vec[0].buf, len);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (!want_quiet)
+				fprintf(stderr, "FATAL: write error: %s\n", strerror(errno));
+			return -1;
+		}
+		jack_ringbuffer_read_advance(stream->rb, rv);
+		stream->partial += rv;
+		frames = stream->partial / bytes_per_frame;
+		stream->partial %= bytes_per_frame;
+		stream->total_captured += frames;
+		stream->file_frames += frames;
+	}
+}
+
+/* report the time from startup until process() handled the first samples */
+void report_startup (jack_thread_info_t *info) {
+	if (atomic_load_explicit(&info->first_sample, memory_order_acquire) != 1)
+		return;
+	atomic_store_explicit(&info->first_sample, 2, memory_order_relaxed);
+	if (!want_quiet) {
+		fprintf(stderr, "first samples after %.1f ms (%u ports)\n",
+				(info->first_time.tv_sec - info->start_mono.tv_sec) * 1e3
+				+ (info->first_time.tv_nsec - info->start_mono.tv_nsec) * 1e-6,
+				info->channels);
+	}
+}
 
-	int writerrors =0;
+void * io_thread (void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	struct pollfd *pfd = (struct pollfd *) calloc(info->nstreams + 1, sizeof(struct pollfd));
+	jack_stream_t **pstream = (jack_stream_t **) calloc(info->nstreams + 1, sizeof(jack_stream_t *));
+	unsigned int s;
 
 	while (run) {
-		/* Write the data one frame at a time.  This is
-		 * inefficient, but makes things simpler. */
-		while (info->can_capture &&
-		       (jack_ringbuffer_read_space (rb) >= bytes_per_frame)) {
+		int active = 0;
+		nfds_t n = 1;
 
-			if (info->duration > 0 && total_captured >= info->duration) {
-				if (!want_quiet)
-					fprintf(stderr, "io thread finished\n");
-				goto done;
+		pfd[0].fd = wake_pipe[0];
+		pfd[0].events = POLLIN;
+
+		for (s = 0; s < info->nstreams; ++s) {
+			jack_stream_t *stream = &info->streams[s];
+			if (stream->done)
+				continue;
+			switch (write_stream(stream)) {
+				case 1:
+					if (!want_quiet)
+						fprintf(stderr, "io thread finished\n");
+					/* fallthrough */
+				case -1:
+					stream->done = 1;
+					continue;
+				default:
+					break;
+			}
+			++active;
+			/* file is not ready to accept all pending data,
+			 * or process() waits for the reader to release spliced data */
+			if ((stream_pending(stream) > 0 && !stream->wait_next)
+					|| (stream->inflight > 0 && info->io_wait)) {
+				pfd[n].fd = stream->fd;
+				pfd[n].events = POLLOUT;
+				pstream[n] = stream;
+				++n;
 			}
+		}
 
-			#if 0 
-			/* wait (indefinitley) for write-ready
-			 * this select() is only needed if fileno(stdout) is non-blocking
-			 */
-			fd_set fd;
-			FD_ZERO(&fd);
-			FD_SET(fileno(stdout), &fd);
-			select(fileno(stdout), &fd, NULL, NULL, NULL);
-			#endif
-
-			jack_ringbuffer_read(rb, framebuf, bytes_per_frame);
-			size_t woff = 0;
-			ssize_t rv;
-			while ((rv=write(fileno(stdout), framebuf+woff, bytes_per_frame)) != bytes_per_frame)
-			{
-
-				if (rv<0) {
-					if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
-						if (!want_quiet)
-							fprintf(stderr, "FATAL: write error: %s\n", strerror(errno));
-						goto done;
-					}
-				}
+		if (active == 0)
+			break;
 
-				if (rv>0) woff += rv;
+		signal_progress();
+		update_latency(info);
+		report_startup(info);
 
-				if (++writerrors > 16) {
-					writerrors=0;
-					if (!want_quiet)
-						fprintf(stderr, "write error. retrying.\n");
-					#if 0 /* bail out ?! */
-						/* flush remaining bytes from ringbuffer */
-						if (rv>=0) {
-							rv=0;
-							while (bytes_per_frame - woff - rv > 0) {
-								jack_ringbuffer_read(rb, framebuf, 1);
-							  ++rv;
-							}
-						}
-						break;
-					#endif
-				}
-				
-				#if 0
-				/* this thread can just block..
-				 * this select() is only needed if fileno(stdout) is non-blocking
-				 */
-				fd_set fd;
-				struct timeval tv = { 0, 0 };
-				tv.tv_sec = 0; tv.tv_usec = 1000; // 1ms
-				FD_ZERO(&fd);
-				FD_SET(fileno(stdout), &fd);
-				select(fileno(stdout), &fd, NULL, NULL, &tv);
-				#endif
+		if (poll(pfd, n, -1) < 0 && errno != EINTR) {
+			fprintf(stderr, "FATAL: poll error: %s\n", strerror(errno));
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			char buf[64];
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0) ;
+		}
+
+		for (s = 1; s < n; ++s) {
+			if (pfd[s].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				if (!want_quiet)
+					fprintf(stderr, "FATAL: output '%s' was closed\n",
+							pstream[s]->path ? pstream[s]->path : "stdout");
+				pstream[s]->done = 1;
 			}
-			++total_captured;
 		}
-		pthread_cond_wait(&data_ready, &io_thread_lock);
 	}
 
-done:
-	pthread_mutex_unlock(&io_thread_lock);
-	free(framebuf);
+	free(pfd);
+	free(pstream);
+
+	/* wake up main thread */
+	pthread_mutex_lock(&ctrl_lock);
+	info->io_done = 1;
+	pthread_cond_signal(&ctrl_cond);
+	pthread_mutex_unlock(&ctrl_lock);
+	signal_progress();
 	return 0;
 }
-	
+
+static void mix_gain (jack_default_audio_sample_t * restrict dst,
+		const jack_default_audio_sample_t * restrict src, const float gain, jack_nframes_t nframes) {
+	jack_nframes_t i;
+	for (i = 0; i < nframes; ++i)
+		dst[i] = gain * src[i];
+}
+
+static void mix_add (jack_default_audio_sample_t * restrict dst,
+		const jack_default_audio_sample_t * restrict src, const float gain, jack_nframes_t nframes) {
+	jack_nframes_t i;
+	for (i = 0; i < nframes; ++i)
+		dst[i] += gain * src[i];
+}
+
+/* apply the stream's matrix to nframes (<= MIX_BLOCK) of the input ports,
+ * starting at offset. The outputs are set up in stream->src[], starting at 0. */
+void mix_matrix (jack_stream_t *stream, jack_nframes_t offset, jack_nframes_t nframes) {
+	const matrix_cell_t *cell = stream->matrix;
+	const matrix_cell_t *end = stream->matrix + stream->ncells;
+	unsigned int chn;
+
+	for (chn = 0; chn < stream->channels; ++chn) {
+		if (cell == end || cell->out != chn) {
+			/* unused output channel */
+			stream->src[chn] = silence;
+			continue;
+		}
+		if ((cell + 1 == end || cell[1].out != chn) && cell->gain == 1.f) {
+			/* plain routing, use the input port's buffer */
+			stream->src[chn] = in[cell->in] + offset;
+			++cell;
+			continue;
+		}
+		mix_gain(stream->mix[chn], in[cell->in] + offset, cell->gain, nframes);
+		for (++cell; cell != end && cell->out == chn; ++cell)
+			mix_add(stream->mix[chn], in[cell->in] + offset, cell->gain, nframes);
+		stream->src[chn] = stream->mix[chn];
+	}
+}
+
+static float buffer_peak (const jack_default_audio_sample_t *buf, jack_nframes_t nframes) {
+	float peak = 0.f;
+	jack_nframes_t i;
+	for (i = 0; i < nframes; ++i) {
+		const float a = fabsf(buf[i]);
+		peak = a > peak ? a : peak;
+	}
+	return peak;
+}
+
+/* test if all of the stream's input ports are below the gate threshold */
+int stream_silent (jack_thread_info_t *info, jack_stream_t *stream, jack_nframes_t nframes) {
+	unsigned int i;
+	if (stream->matrix) {
+		for (i = 0; i < stream->ncells; ++i)
+			if (buffer_peak(in[stream->matrix[i].in], nframes) >= info->gate)
+				return 0;
+	} else {
+		for (i = 0; i < stream->channels; ++i)
+			if (buffer_peak(in[stream->first + i], nframes) >= info->gate)
+				return 0;
+	}
+	return 1;
+}
+
+void queue_stream (jack_thread_info_t *info, jack_stream_t *stream, jack_nframes_t nframes) {
+	jack_ringbuffer_t *rb = stream->rb;
+	jack_default_audio_sample_t **src = stream->matrix ? stream->src : &in[stream->first];
+	const size_t bytes_per_frame = stream->channels * SAMPLESIZE;
+	encode_t encode = info->encode;
+	jack_nframes_t done = 0;
+	jack_nframes_t offset;
+	int silent = 0;
+
+	/* replace the whole period with digital silence */
+	if (info->gate > 0 && stream_silent(info, stream, nframes)) {
+		src = silence_src;
+		encode = info->encode_silence;
+		silent = 1;
+	}
+
+	/* queue interleaved samples to the stream's ringbuffer. */
+	while (done < nframes) {
+		jack_ringbuffer_data_t vec[2];
+		jack_nframes_t n;
+
+		jack_ringbuffer_get_write_vector(rb, vec);
+		/* only queue samples if a whole frame (all channels) can be stored */
+		if (vec[0].len + vec[1].len < bytes_per_frame) {
+			if (info->freewheeling && !stream->done && run && !info->io_done) {
+				/* lossless, wait for the io thread to write data */
+				wait_progress(info);
+				continue;
+			}
+			atomic_fetch_add_explicit(&overruns, 1, memory_order_relaxed);
+			break;
+		}
+
+		n = vec[0].len / bytes_per_frame;
+		if (n > nframes - done)
+			n = nframes - done;
+		offset = done;
+		if (stream->matrix || silent) {
+			if (n > MIX_BLOCK)
+				n = MIX_BLOCK;
+			if (!silent)
+				mix_matrix(stream, done, n > 0 ? n : 1);
+			offset = 0;
+		}
+		if (n > 0) {
+			/* convert directly into the ringbuffer */
+			encode(vec[0].buf, src, stream->dither, stream->channels, offset, n);
+			jack_ringbuffer_write_advance(rb, n * bytes_per_frame);
+		} else {
+			/* the next frame wraps around the end of the ringbuffer */
+			encode(stream->frame, src, stream->dither, stream->channels, offset, 1);
+			jack_ringbuffer_write(rb, stream->frame, bytes_per_frame);
+			n = 1;
+		}
+		done += n;
+	}
+}
+
 int process (jack_nframes_t nframes, void *arg) {
 	int chn;
-	size_t i;
+	unsigned int s;
 	jack_thread_info_t *info = (jack_thread_info_t *) arg;
-	const size_t bytes_per_frame = info->channels * SAMPLESIZE;
 
 	/* Do nothing until we're ready to begin. */
 	if ((!info->can_process) || (!info->can_capture))
@@ -198,68 +919,184 @@ int process (jack_nframes_t nframes, void *arg) {
 	for (chn = 0; chn < info->channels; ++chn)
 		in[chn] = jack_port_get_buffer(ports[chn], nframes);
 
-	/* queue interleaved samples to a single ringbuffer. */
-	for (i = 0; i < nframes; i++) {
-		/* only queue samples if a whole frame (all channels) can be stored */
-		if (jack_ringbuffer_write_space(rb) < bytes_per_frame ) {
-			overruns++;
-			break;
-		}
-
-		for (chn = 0; chn < info->channels; ++chn) {
-			const jack_default_audio_sample_t js = in[chn][i];
-			if (IS_FMTFLT) {
-				/* 32 bit float */
-				float d;
-				if (IS_BIGEND) {
-					/* swap float endianess */
-					char *flin = (char*) & js;
-					char *fout = (char*) & d;
-					fout[0] = flin[3];
-					fout[1] = flin[2];
-					fout[2] = flin[1];
-					fout[3] = flin[0];
-				} else {
-				  d = js;
-				}
-				jack_ringbuffer_write(rb, (void *) &d, SAMPLESIZE);
-			} else {
-				/* 8/16/24 LE/BE signed/unsigned */
-				const int32_t d = (int32_t) rintf(js*FMTMLT) + FMTOFF;
-				char bytes[4];
-				bytes[BE(0)] = (unsigned char) (d&0xff);
-				if (IS_FMT16B || IS_FMT24B || IS_FMT32B)
-					bytes[BE(1)] = (unsigned char) (((d&0xff00)>>8)&0xff);
-				if (IS_FMT24B || IS_FMT32B)
-					bytes[BE(2)] = (unsigned char) (((d&0xff0000)>>16)&0xff);
-				if (IS_FMT32B)
-					bytes[BE(3)] = (unsigned char) (((d&0xff000000)>>24)&0xff);
-				jack_ringbuffer_write (rb, (void *) &bytes, SAMPLESIZE);
-			}
-		}
+	if (!atomic_load_explicit(&info->first_sample, memory_order_relaxed)) {
+		clock_gettime(CLOCK_MONOTONIC, &info->first_time);
+		atomic_store_explicit(&info->first_sample, 1, memory_order_release);
 	}
+
+	for (s = 0; s < info->nstreams; ++s)
+		queue_stream(info, &info->streams[s], nframes);
+
 	/* Tell the io thread there is work to do. */
-	if (pthread_mutex_trylock(&io_thread_lock) == 0) {
-	    pthread_cond_signal(&data_ready);
-	    pthread_mutex_unlock(&io_thread_lock);
-	}
+	wake_io();
 
 	return 0;
 }
 
+void jack_freewheel (int starting, void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	info->freewheeling = starting;
+}
+
+/* data on the input ports is written out after info->latency frames */
+void jack_latency (jack_latency_callback_mode_t mode, void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	jack_latency_range_t range;
+	unsigned int i;
+
+	if (mode != JackPlaybackLatency || !info->can_process)
+		return;
+	range.min = range.max = info->latency;
+	for (i = 0; i < info->channels; i++)
+		jack_port_set_latency_range(ports[i], mode, &range);
+}
+
 void jack_shutdown (void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
 	fprintf(stderr, "JACK shutdown\n");
-	abort();
+	if (!info->want_reconnect)
+		abort();
+
+	/* keep stdout open, main thread will re-connect */
+	info->can_process = 0;
+	pthread_mutex_lock(&ctrl_lock);
+	info->jack_lost = 1;
+	pthread_cond_signal(&ctrl_cond);
+	pthread_mutex_unlock(&ctrl_lock);
 }
 
-void setup_ports (int nports, char *source_names[], jack_thread_info_t *info) {
+void port_registration (jack_port_id_t id, int reg, void *arg) {
+	jack_thread_info_t *info = (jack_thread_info_t *) arg;
+	jack_port_t *port;
 	unsigned int i;
+
+	if (!reg || !(port = jack_port_by_id(info->client, id)))
+		return;
+
+	/* a source port (re)appeared, connect it from the main thread */
+	for (i = 0; i < info->channels; i++) {
+		if (strcmp(jack_port_name(port), info->source_names[i]))
+			continue;
+		pthread_mutex_lock(&ctrl_lock);
+		info->connect_pending = 1;
+		pthread_cond_signal(&ctrl_cond);
+		pthread_mutex_unlock(&ctrl_lock);
+		break;
+	}
+}
+
+/* port names enclosed in slashes are extended regular expressions,
+ * names containing *, ? or [ are shell glob patterns, unless a port
+ * has exactly that name, e.g. "client:out [L]" */
+static int is_port_pattern (jack_client_t *client, const char *name) {
+	const size_t len = strlen(name);
+	if (jack_port_by_name(client, name))
+		return 0;
+	if (len > 1 && name[0] == '/' && name[len - 1] == '/')
+		return 1;
+	return strpbrk(name, "*?[") != NULL;
+}
+
+/* resolve port patterns with a single jack_get_ports() call.
+ * Returns a new array of *nnames names, NULL if a pattern matches
+ * no port. If counts is given, counts[i] is set to the number of
+ * ports that names[i] expanded to. */
+char ** expand_ports (jack_client_t *client, char **names, unsigned int *nnames,
+		unsigned long flags, unsigned int *counts) {
+	const char **all = NULL;
+	char **rv;
+	unsigned int i, j, n = 0, nall = 0, max = *nnames;
+	int ok = 1;
+
+	for (i = 0; i < *nnames; ++i) {
+		if (!is_port_pattern(client, names[i]))
+			continue;
+		if (!all) {
+			all = jack_get_ports(client, NULL, JACK_DEFAULT_AUDIO_TYPE, flags);
+			while (all && all[nall])
+				++nall;
+		}
+		max += nall;
+	}
+
+	rv = (char **) malloc(max * sizeof(char *));
+	for (i = 0; ok && i < *nnames; ++i) {
+		const unsigned int first = n;
+		if (!is_port_pattern(client, names[i])) {
+			rv[n++] = strdup(names[i]);
+		} else if (names[i][0] == '/') {
+			regex_t re;
+			char *expr = strdup(names[i] + 1);
+			expr[strlen(expr) - 1] = '\0';
+			if (regcomp(&re, expr, REG_EXTENDED | REG_NOSUB)) {
+				fprintf(stderr, "invalid port pattern '%s'.\n", names[i]);
+				free(expr);
+				ok = 0;
+				break;
+			}
+			for (j = 0; j < nall; ++j) {
+				if (!regexec(&re, all[j], 0, NULL, 0))
+					rv[n++] = strdup(all[j]);
+			}
+			regfree(&re);
+			free(expr);
+		} else {
+			for (j = 0; j < nall; ++j) {
+				if (!fnmatch(names[i], all[j], 0))
+					rv[n++] = strdup(all[j]);
+			}
+		}
+		if (n == first) {
+			fprintf(stderr, "No port matches '%s'.\n", names[i]);
+			ok = 0;
+		} else if (counts) {
+			counts[i] = n - first;
+		}
+	}
+	if (all)
+		jack_free(all);
+
+	if (!ok) {
+		for (i = 0; i < n; ++i)
+			free(rv[i]);
+		free(rv);
+		return NULL;
+	}
+	*nnames = n;
+	return rv;
+}
+
+void setup_buffers (int nports, jack_thread_info_t *info) {
+	unsigned int s, chn, maxchn = 0;
 	const size_t in_size =  nports * sizeof(jack_default_audio_sample_t *);
 
 	/* Allocate data structures that depend on the number of ports. */
 	ports = (jack_port_t **) malloc(sizeof(jack_port_t *) * nports);
 	in = (jack_default_audio_sample_t **) malloc(in_size);
-	rb = jack_ringbuffer_create(nports * SAMPLESIZE * info->rb_size);
+	for (s = 0; s < info->nstreams; ++s) {
+		jack_stream_t *stream = &info->streams[s];
+		stream->rb = jack_ringbuffer_create(stream->channels * SAMPLESIZE * info->rb_size);
+		memset(stream->rb->buf, 0, stream->rb->size);
+		stream->frame = (char *) calloc(stream->channels, SAMPLESIZE);
+		if (stream->channels > maxchn)
+			maxchn = stream->channels;
+		stream->dither = (dither_t *) calloc(stream->channels, sizeof(dither_t));
+		for (chn = 0; chn < stream->channels; ++chn)
+			stream->dither[chn].rnd = 2463534242U + 7919U * (s * 256 + chn);
+		if (stream->matrix) {
+			stream->mix = (jack_default_audio_sample_t **) malloc(stream->channels * sizeof(jack_default_audio_sample_t *));
+			stream->src = (jack_default_audio_sample_t **) calloc(stream->channels, sizeof(jack_default_audio_sample_t *));
+			for (chn = 0; chn < stream->channels; ++chn) {
+				stream->mix[chn] = (jack_default_audio_sample_t *) malloc(MIX_BLOCK * sizeof(jack_default_audio_sample_t));
+				memset(stream->mix[chn], 0, MIX_BLOCK * sizeof(jack_default_audio_sample_t));
+			}
+		}
+	}
+	silence = (jack_default_audio_sample_t *) malloc(MIX_BLOCK * sizeof(jack_default_audio_sample_t));
+	memset(silence, 0, MIX_BLOCK * sizeof(jack_default_audio_sample_t));
+	silence_src = (jack_default_audio_sample_t **) malloc(maxchn * sizeof(jack_default_audio_sample_t *));
+	for (chn = 0; chn < maxchn; ++chn)
+		silence_src[chn] = silence;
 
 	/* When JACK is running realtime, jack_activate() will have
 	 * called mlockall() to lock our pages into memory.  But, we
@@ -267,7 +1104,31 @@ void setup_ports (int nports, char *source_names[], jack_thread_info_t *info) {
 	 * process() starts using them.  Otherwise, a page fault could
 	 * create a delay that would force JACK to shut us down. */
 	memset(in, 0, in_size);
-	memset(rb->buf, 0, rb->size);
+}
+
+void connect_ports (jack_thread_info_t *info, int verbose) {
+	unsigned int i;
+
+	for (i = 0; i < info->channels; i++) {
+		if (jack_port_connected_to(ports[i], info->source_names[i]))
+			continue;
+		/* on re-connect, silently skip sources that do not exist (yet) */
+		if (!verbose && !jack_port_by_name(info->client, info->source_names[i]))
+			continue;
+		if (jack_connect(info->client, info->source_names[i], jack_port_name(ports[i]))) {
+			fprintf(stderr, "cannot connect input port %s to %s\n", jack_port_name(ports[i]), info->source_names[i]);
+#if 0 /* not fatal - connect manually */
+			jack_client_close(info->client);
+			exit(1);
+#endif
+		} else if (!verbose && !want_quiet) {
+			fprintf(stderr, "connected input port %s to %s\n", jack_port_name(ports[i]), info->source_names[i]);
+		}
+	}
+}
+
+int setup_ports (int nports, jack_thread_info_t *info) {
+	unsigned int i;
 
 	for (i = 0; i < nports; i++) {
 		char name[64];
@@ -276,23 +1137,384 @@ void setup_ports (int nports, char *source_names[], jack_thread_info_t *info) {
 
 		if ((ports[i] = jack_port_register(info->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0)) == 0) {
 			fprintf(stderr, "cannot register input port \"%s\"!\n", name);
-			jack_client_close(info->client);
-			exit(1);
+			return -1;
 		}
 	}
+	return 0;
+}
 
-	for (i = 0; i < nports; i++) {
-		if (jack_connect(info->client, source_names[i], jack_port_name(ports[i]))) {
-			fprintf(stderr, "cannot connect input port %s to %s\n", jack_port_name(ports[i]), source_names[i]);
-#if 0 /* not fatal - connect manually */
-			jack_client_close(info->client);
-			exit(1);
-#endif
-		}
+/* connect to the JACK server, without activating the client */
+int open_client (jack_thread_info_t *info) {
+	jack_client_t *client;
+	jack_status_t jstat;
+
+	if ((client = jack_client_open(info->client_name, JackNoStartServer, &jstat)) == 0) {
+		return -1;
+	}
+
+	info->client = client;
+	info->can_process = 0;
+	info->period = jack_get_buffer_size(client);
+
+	if (info->samplerate == 0) {
+		info->samplerate = jack_get_sample_rate(client);
+	} else if (info->samplerate != jack_get_sample_rate(client)) {
+		fprintf(stderr, "Warning: JACK sample-rate changed from %d to %d\n",
+				info->samplerate, jack_get_sample_rate(client));
+	}
+	return 0;
+}
+
+int open_jack (jack_thread_info_t *info) {
+	jack_client_t *client;
+
+	/* main() opens the client early, to resolve port patterns */
+	if (!info->client && open_client(info)) {
+		return -1;
+	}
+	client = info->client;
+
+	/* bail out if buffer is smaller than twice the jack period */
+	if ((info->rb_size>>1) < jack_get_buffer_size(client)) {
+		fprintf(stderr, "Ringbuffer size needs to be at least twice jack period size\n");
+		jack_client_close(client);
+		info->client = NULL;
+		return -2;
+	}
+
+	jack_set_process_callback(client, process, info);
+	jack_set_port_registration_callback(client, port_registration, info);
+	jack_set_freewheel_callback(client, jack_freewheel, info);
+	jack_set_latency_callback(client, jack_latency, info);
+	jack_on_shutdown(client, jack_shutdown, info);
+
+	/* register all ports before activation, so that the graph is only
+	 * re-ordered once. Connections require an active client. */
+	if (setup_ports(info->channels, info)) {
+		jack_client_close(client);
+		info->client = NULL;
+		return -2;
 	}
 
+	if (jack_activate(client)) {
+		fprintf(stderr, "cannot activate client");
+	}
+
+	connect_ports(info, 1);
+
 	/* process() can start, now */
 	info->can_process = 1;
+	jack_recompute_total_latencies(client);
+	return 0;
+}
+
+void reopen_jack (jack_thread_info_t *info) {
+	jack_client_close(info->client);
+	info->client = NULL;
+
+	while (run && !info->io_done) {
+		if (!want_quiet)
+			fprintf(stderr, "trying to re-connect to JACK..\n");
+		switch (open_jack(info)) {
+			case 0:
+				if (!want_quiet)
+					fprintf(stderr, "re-connected to JACK.\n");
+				return;
+			case -2:
+				/* fatal, e.g. ringbuffer too small for new period-size */
+				run = 0;
+				wake_io();
+				return;
+			default:
+				break;
+		}
+		sleep(1);
+	}
+}
+
+/* file-name of the given file of a rotated stream */
+char * output_filename (jack_stream_t *stream, unsigned int index, time_t t) {
+	const size_t len = strlen(stream->path) + 256;
+	char *path = (char *) malloc(len);
+	struct tm tm;
+
+	if (!strchr(stream->path, '%')) {
+		snprintf(path, len, "%s.%04u", stream->path, index);
+		return path;
+	}
+
+	localtime_r(&t, &tm);
+	if (strftime(path, len, stream->path, &tm) == 0)
+		snprintf(path, len, "%s.%04u", stream->path, index);
+	return path;
+}
+
+/* name the current file by the actual time of its first frame,
+ * it was created ahead of time with a predicted name */
+void rename_file (jack_stream_t *stream) {
+	char *path, *name;
+	double start;
+	unsigned int index;
+
+	pthread_mutex_lock(&ctrl_lock);
+	stream->name_pending = 0;
+	path = stream->cur_path ? strdup(stream->cur_path) : NULL;
+	start = stream->file_start;
+	index = stream->cur_index;
+	pthread_mutex_unlock(&ctrl_lock);
+
+	if (!path || !strchr(stream->path, '%')) {
+		free(path);
+		return;
+	}
+
+	name = output_filename(stream, index, (time_t) floor(start + .5));
+	if (strcmp(name, path) && access(name, F_OK)) {
+		if (rename(path, name)) {
+			fprintf(stderr, "Can not rename '%s' to '%s': %s\n", path, name, strerror(errno));
+		} else {
+			pthread_mutex_lock(&ctrl_lock);
+			if (stream->cur_path && !strcmp(stream->cur_path, path)) {
+				free(stream->cur_path);
+				stream->cur_path = name;
+				name = NULL;
+			}
+			pthread_mutex_unlock(&ctrl_lock);
+		}
+	}
+	free(name);
+	free(path);
+}
+
+/* open the next file of all rotated streams, ahead of time */
+void prepare_next_files (jack_thread_info_t *info) {
+	unsigned int s;
+
+	for (s = 0; s < info->nstreams; ++s) {
+		jack_stream_t *stream = &info->streams[s];
+		double start;
+		char *path;
+		int fd;
+
+		if (!stream->rotate)
+			continue;
+		if (stream->name_pending)
+			rename_file(stream);
+		if (stream->done || stream->next_fd >= 0)
+			continue;
+
+		/* predict the start of the next file, it is renamed if that was off */
+		pthread_mutex_lock(&ctrl_lock);
+		if (info->rotate_interval > 0)
+			start = stream->boundary;
+		else if (stream->file_start > 0)
+			start = stream->file_start + (double) stream->file_length / info->samplerate;
+		else
+			start = info->start_time.tv_sec + (double) info->rotate_length / info->samplerate;
+		pthread_mutex_unlock(&ctrl_lock);
+
+		path = output_filename(stream, stream->files_opened, (time_t) floor(start + .5));
+		if (!strchr(stream->path, '%')) {
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+		} else {
+			/* the time may expand to the name of the current or an earlier
+			 * file, never overwrite it: append the sequence number instead */
+			fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NONBLOCK, 0644);
+			if (fd < 0 && errno == EEXIST) {
+				const size_t len = strlen(path) + 16;
+				char *indexed = (char *) malloc(len);
+				snprintf(indexed, len, "%s.%04u", path, stream->files_opened);
+				free(path);
+				path = indexed;
+				fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NONBLOCK, 0644);
+			}
+		}
+		if (fd < 0) {
+			fprintf(stderr, "Can not open file '%s': %s. Continuing with current file.\n", path, strerror(errno));
+			free(path);
+			path = NULL;
+			fd = dup(stream->fd);
+		}
+		++stream->files_opened;
+
+		pthread_mutex_lock(&ctrl_lock);
+		free(stream->next_path);
+		stream->next_path = path;
+		stream->next_index = stream->files_opened - 1;
+		stream->next_fd = fd;
+		pthread_mutex_unlock(&ctrl_lock);
+	}
+	wake_io();
+}
+
+static int cmp_cell (const void *a, const void *b) {
+	const matrix_cell_t *ca = (const matrix_cell_t *) a;
+	const matrix_cell_t *cb = (const matrix_cell_t *) b;
+	if (ca->out != cb->out)
+		return ca->out < cb->out ? -1 : 1;
+	return ca->in < cb->in ? -1 : (ca->in > cb->in);
+}
+
+/* parse "out=in[*gain][+in[*gain]...][,out=...]", channels count from 1,
+ * the gain is a factor or given in dB, e.g. "3=1*-3dB+2*-3dB".
+ * Returns the number of output channels, or 0 on error. */
+unsigned int parse_matrix (const char *spec, matrix_cell_t **matrix, unsigned int *ncells) {
+	const char *p = spec;
+	char *end;
+	unsigned int n = 0;
+	unsigned int outputs = 0;
+	matrix_cell_t *cells = (matrix_cell_t *) malloc((strlen(spec) / 2 + 1) * sizeof(matrix_cell_t));
+
+	while (*p) {
+		const unsigned long out = strtoul(p, &end, 10);
+		if (end == p || *end != '=' || out < 1 || out > 1024)
+			goto fail;
+		p = end + 1;
+		for (;;) {
+			const unsigned long in = strtoul(p, &end, 10);
+			float gain = 1.f;
+			if (end == p || in < 1 || in > 1024)
+				goto fail;
+			p = end;
+			if (*p == '*') {
+				gain = strtof(p + 1, &end);
+				if (end == p + 1)
+					goto fail;
+				p = end;
+				if (!strncmp(p, "dB", 2)) {
+					gain = powf(10.f, .05f * gain);
+					p += 2;
+				}
+			}
+			cells[n].out = out - 1;
+			cells[n].in = in - 1;
+			cells[n].gain = gain;
+			++n;
+			if (out > outputs)
+				outputs = out;
+			if (*p != '+')
+				break;
+			++p;
+		}
+		if (*p == ',')
+			++p;
+		else if (*p)
+			goto fail;
+	}
+	if (n == 0)
+		goto fail;
+
+	qsort(cells, n, sizeof(matrix_cell_t), cmp_cell);
+	*matrix = cells;
+	*ncells = n;
+	return outputs;
+
+fail:
+	free(cells);
+	return 0;
+}
+
+#ifdef __linux__
+/* parse a list of CPUs, e.g. "0,2-3". returns 0 on success */
+int parse_cpus (const char *list, cpu_set_t *set) {
+	const char *p = list;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*p) {
+		unsigned long first, last;
+		first = last = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+		p = end;
+		if (*p == '-') {
+			last = strtoul(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				return -1;
+			p = end;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+		if (*p == ',')
+			++p;
+		else if (*p)
+			return -1;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+#endif
+
+/* apply CPU affinity, scheduling and memory locking to the io thread.
+ * Failures are not fatal, the settings that took effect are reported. */
+void setup_io_thread (jack_thread_info_t *info) {
+	struct sched_param param;
+	int policy, rv;
+	int locked = 0;
+
+	if (info->io_cpus) {
+#ifdef __linux__
+		cpu_set_t set;
+		parse_cpus(info->io_cpus, &set);
+		if ((rv = pthread_setaffinity_np(info->thread_id, sizeof(set), &set)))
+			fprintf(stderr, "Warning: can not set io thread CPU affinity: %s\n", strerror(rv));
+#else
+		fprintf(stderr, "Warning: CPU affinity is not supported on this platform.\n");
+#endif
+	}
+
+	if (info->io_priority != 0) {
+		int prio = info->io_priority;
+		if (prio < 0) {
+			/* relative to the JACK process thread */
+			const int jack_prio = jack_client_real_time_priority(info->client);
+			if (jack_prio < 0) {
+				fprintf(stderr, "Warning: JACK is not running realtime, io thread priority is unchanged.\n");
+				prio = 0;
+			} else {
+				prio += jack_prio;
+			}
+		}
+		if (prio > 0) {
+			if (prio < sched_get_priority_min(info->io_policy))
+				prio = sched_get_priority_min(info->io_policy);
+			if (prio > sched_get_priority_max(info->io_policy))
+				prio = sched_get_priority_max(info->io_policy);
+			param.sched_priority = prio;
+			if ((rv = pthread_setschedparam(info->thread_id, info->io_policy, &param)))
+				fprintf(stderr, "Warning: can not set io thread priority: %s\n", strerror(rv));
+		}
+	}
+
+	if (info->want_mlock) {
+		/* MCL_CURRENT also faults in all stacks and buffers allocated so far */
+		if (mlockall(MCL_CURRENT | MCL_FUTURE))
+			fprintf(stderr, "Warning: can not lock memory: %s\n", strerror(errno));
+		else
+			locked = 1;
+	}
+
+	if (want_quiet)
+		return;
+	if (pthread_getschedparam(info->thread_id, &policy, &param))
+		policy = SCHED_OTHER;
+	fprintf(stderr, "io thread: %s", policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER");
+	if (policy == SCHED_FIFO || policy == SCHED_RR)
+		fprintf(stderr, " priority %d", param.sched_priority);
+#ifdef __linux__
+	if (info->io_cpus) {
+		cpu_set_t set;
+		if (pthread_getaffinity_np(info->thread_id, sizeof(set), &set) == 0) {
+			int cpu, sep = 0;
+			fprintf(stderr, ", CPUs");
+			for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+				if (CPU_ISSET(cpu, &set))
+					fprintf(stderr, "%c%d", sep++ ? ',' : ' ', cpu);
+		}
+	}
+#endif
+	fprintf(stderr, "%s.\n", locked ? ", memory locked" : "");
 }
 
 void catchsig (int sig) {
@@ -303,54 +1525,99 @@ void catchsig (int sig) {
 		fprintf(stderr,"\n CAUGHT SIGNAL - shutting down.\n");
 	run=0;
 	/* signal writer thread */
-	pthread_mutex_lock(&io_thread_lock);
-	pthread_cond_signal(&data_ready);
-	pthread_mutex_unlock(&io_thread_lock);
+	wake_io();
 }
 
 
 static void usage (const char *name, int status) {
 	fprintf(status?stderr:stdout,
-		"usage: %s [ OPTIONS ] port1 [ port2 ... ]\n", name);
+		"usage: %s [ OPTIONS ] port1 [ port2 ... ] [ -o file port ... ]\n", name);
 	fprintf(status?stderr:stdout,
 		"jack-stdout captures audio-data from JACK and writes it to standard-output.\n");
 	fprintf(status?stderr:stdout,
 	  "OPTIONS:\n"
 	  " -h, --help               print this message\n"
 	  " -q, --quiet              inhibit usual output\n"
+	  " -m, --matrix {spec}      route and mix ports to the current output's\n"
+		"                          channels, spec: out=in[*gain][+in[*gain]..],..\n"
+		"                          e.g. \"1=1,2=2,3=1*-3dB+2*-3dB\"\n"
+	  " -r, --rotate {sec}       start a new output file every given seconds,\n"
+		"                          aligned to wall-clock time (e.g. 3600: hourly)\n"
+	  " -F, --rotate-frames {n}  start a new output file every n frames\n"
 	  " -b, --bitdepth {bits}    choose integer bit depth: 16, 24 (default: 16)\n"
-	  " -d, --duration {sec}     terminate after given time, <1: unlimited (default:0)\n"
+	  " -c, --frames {n}         terminate after given number of frames\n"
+	  " -d, --duration {sec}     terminate after given time, may be fractional,\n"
+		"                          <=0: unlimited (default:0)\n"
+	  " -D, --dither {type}      dither 8..24 bit integers: none, tpdf, shaped\n"
+		"                          (1st order), shaped2 (2nd order) (default: none)\n"
 	  " -e, --encoding {format}  set output format: (default: signed)\n"
 		"                          signed-integer, unsigned-integer, float\n"
+	  " -g, --gate {dBFS}        write periods with a peak below the given level\n"
+		"                          as digital silence\n"
 	  " -n, --name {clientname}  set client name in JACK instead of jstdout\n"
+	  " -o, --output {filename}  write the ports that follow to given file\n"
+		"                          instead of stdout. May be given multiple times.\n"
+	  " -k, --low-latency        keep output pipes small, to bound the latency\n"
+	  " -R, --reconnect          keep running and re-connect if JACK shuts down\n"
+	  " -a, --affinity {cpus}    run the io thread on given CPUs, e.g. 0,2-3\n"
+	  " -M, --mlock              lock all memory, avoid page-faults\n"
+	  " -P, --io-priority {prio} run the io thread with SCHED_FIFO priority,\n"
+		"                          <0: relative to JACK (e.g. -1), rr:{prio}\n"
+		"                          for SCHED_RR (default: 0, not realtime)\n"
 	  " -L, --little-endian      write little-endian integers or\n"
 		"                          native-byte-order floats (default)\n"
 	  " -B, --big-endian         write big-endian integers or swapped-order floats\n"
 	  " -S, --bufsize {samples}  set buffer size (default: 64k)\n"
+	  " -z, --sparse             do not write silence to regular files, leave\n"
+		"                          holes instead (signed-integer and float only)\n"
+	  " -Z, --zero-copy          pass data to pipes with vmsplice(), only if the\n"
+		"                          reader uses read(), not splice() (Linux only)\n"
+	  "Ports may be given as shell patterns, e.g. \"system:capture_*\", or as\n"
+	  "extended regular expressions in slashes, e.g. \"/capture_[12]$/\".\n"
 		);
 	exit(status);
 }
 
 int main (int argc, char **argv) {
-	jack_client_t *client;
 	jack_thread_info_t thread_info;
-	jack_status_t jstat;
-	int c;
-	char *client_name = "jstdout";
+	jack_stream_t *stream = NULL;
+	char **port_names;
+	unsigned int s, nports = 0;
+	int c, to_stdout = 0;
 
 	memset(&thread_info, 0, sizeof(thread_info));
+	clock_gettime(CLOCK_MONOTONIC, &thread_info.start_mono);
 	thread_info.rb_size = 16384 * 4;
 	thread_info.channels = 2;
 	thread_info.duration = 0;
 	thread_info.format = 0;
+	thread_info.client_name = "jstdout";
 
-	const char *optstring = "d:e:b:S:n:BLhq";
+	/* ports and output files are parsed in order, see case 'o' */
+	port_names = (char **) calloc(argc, sizeof(char *));
+	thread_info.streams = (jack_stream_t *) calloc(argc, sizeof(jack_stream_t));
+
+	const char *optstring = "-a:c:d:D:e:b:g:S:n:m:o:r:F:P:BkLMRhqzZ";
 	struct option long_options[] = {
 		{ "help", 0, 0, 'h' },
 		{ "quiet", 0, 0, 'q' },
 		{ "duration", 1, 0, 'd' },
+		{ "frames", 1, 0, 'c' },
+		{ "dither", 1, 0, 'D' },
 		{ "encoding", 1, 0, 'e' },
 		{ "name", 1, 0, 'n' },
+		{ "output", 1, 0, 'o' },
+		{ "matrix", 1, 0, 'm' },
+		{ "gate", 1, 0, 'g' },
+		{ "sparse", 0, 0, 'z' },
+		{ "zero-copy", 0, 0, 'Z' },
+		{ "rotate", 1, 0, 'r' },
+		{ "rotate-frames", 1, 0, 'F' },
+		{ "reconnect", 0, 0, 'R' },
+		{ "affinity", 1, 0, 'a' },
+		{ "mlock", 0, 0, 'M' },
+		{ "low-latency", 0, 0, 'k' },
+		{ "io-priority", 1, 0, 'P' },
 		{ "little-endian", 0, 0, 'L' },
 		{ "big-endian", 0, 0, 'B' },
 		{ "bitdepth", 1, 0, 'b' },
@@ -367,10 +1634,103 @@ int main (int argc, char **argv) {
 				want_quiet = 1;
 				break;
 			case 'n':
-				client_name = optarg;
+				thread_info.client_name = optarg;
+				break;
+			case 'R':
+				thread_info.want_reconnect = 1;
+				break;
+			case 'a':
+#ifdef __linux__
+				{
+					cpu_set_t set;
+					if (parse_cpus(optarg, &set)) {
+						fprintf(stderr, "invalid CPU list.\n");
+						usage(argv[0], 1);
+					}
+				}
+#endif
+				thread_info.io_cpus = optarg;
+				break;
+			case 'M':
+				thread_info.want_mlock = 1;
+				break;
+			case 'k':
+				thread_info.low_latency = 1;
+				break;
+			case 'P':
+				thread_info.io_policy = SCHED_FIFO;
+				if (!strncmp(optarg, "rr:", 3)) {
+					thread_info.io_policy = SCHED_RR;
+					optarg += 3;
+				}
+				thread_info.io_priority = atoi(optarg);
+				break;
+			case 'r':
+				thread_info.rotate_interval = atoi(optarg);
+				thread_info.rotate_length = 0;
+				break;
+			case 'F':
+				thread_info.rotate_interval = 0;
+				thread_info.rotate_length = strtoull(optarg, NULL, 10);
+				break;
+			case 'o':
+				stream = &thread_info.streams[thread_info.nstreams++];
+				stream->path = optarg;
+				stream->first = nports;
+				break;
+			case 'm':
+				if (!stream) {
+					stream = &thread_info.streams[thread_info.nstreams++];
+					stream->path = NULL;
+					stream->first = nports;
+				}
+				free(stream->matrix);
+				stream->matrix = NULL;
+				if (!parse_matrix(optarg, &stream->matrix, &stream->ncells)) {
+					fprintf(stderr, "invalid matrix '%s'.\n", optarg);
+					usage(argv[0], 1);
+				}
+				break;
+			case 1:
+				/* port-name, added to the current stream */
+				if (!stream) {
+					stream = &thread_info.streams[thread_info.nstreams++];
+					stream->path = NULL;
+					stream->first = nports;
+				}
+				port_names[nports++] = optarg;
+				stream->channels++;
 				break;
 			case 'd':
-				thread_info.duration = atoi(optarg);
+				thread_info.seconds = atof(optarg);
+				thread_info.duration = 0;
+				break;
+			case 'c':
+				thread_info.duration = strtoull(optarg, NULL, 10);
+				thread_info.seconds = 0;
+				break;
+			case 'g':
+				thread_info.gate = powf(10.f, .05f * atof(optarg));
+				break;
+			case 'z':
+				thread_info.want_sparse = 1;
+				break;
+			case 'Z':
+				thread_info.want_splice = 1;
+				break;
+			case 'D':
+				if (!strcmp(optarg, "none"))
+					thread_info.dither = 0;
+				else if (!strcmp(optarg, "tpdf"))
+					thread_info.dither = 1;
+				else if (!strcmp(optarg, "shaped"))
+					thread_info.dither = 2;
+				else if (!strcmp(optarg, "shaped2"))
+					thread_info.dither = 3;
+				else {
+					fprintf(stderr, "invalid dither. valid values: none, tpdf, shaped, shaped2.\n");
+					usage(argv[0], 1);
+				}
 				break;
 			case 'e':
 				thread_info.format&=~0x30;
@@ -420,43 +1780,155 @@ int main (int argc, char **argv) {
 		thread_info.format|=3;
 	}
 
-	if (argc <= optind) {
+	if (nports == 0) {
 		fprintf(stderr, "At least one port/audio-channel must be given.\n");
 		usage(argv[0], 1);
 	}
 
-	/* set up JACK client */
-	if ((client = jack_client_open(client_name, JackNoStartServer, &jstat)) == 0) {
+	/* connect to JACK early, port patterns are resolved against its ports */
+	if (open_client(&thread_info)) {
 		fprintf(stderr, "Can not connect to JACK.\n");
 		exit(1);
+	} else {
+		unsigned int *counts = (unsigned int *) calloc(nports, sizeof(unsigned int));
+		char **names = expand_ports(thread_info.client, port_names, &nports, JackPortIsOutput, counts);
+		unsigned int i, n = 0;
+		if (!names) {
+			jack_client_close(thread_info.client);
+			exit(1);
+		}
+		/* each output takes a range of the expanded port list */
+		for (s = 0; s < thread_info.nstreams; ++s) {
+			stream = &thread_info.streams[s];
+			const unsigned int first = n;
+			for (i = stream->first; i < stream->first + stream->channels; ++i)
+				n += counts[i];
+			stream->first = first;
+			stream->channels = n - first;
+		}
+		free(counts);
+		free(port_names);
+		port_names = names;
 	}
 
-	thread_info.client = client;
-	thread_info.can_process = 0;
-	thread_info.channels = argc - optind;
+	clock_gettime(CLOCK_REALTIME, &thread_info.start_time);
 
-	if (thread_info.duration > 0) {
-		thread_info.duration *= jack_get_sample_rate(thread_info.client);
+	for (s = 0; s < thread_info.nstreams; ++s) {
+		char *path;
+		stream = &thread_info.streams[s];
+		stream->info = &thread_info;
+		stream->next_fd = -1;
+		if (stream->matrix) {
+			unsigned int i;
+			for (i = 0; i < stream->ncells; ++i) {
+				if (stream->matrix[i].in >= nports) {
+					fprintf(stderr, "Matrix input %u does not exist, there are %u ports.\n",
+							stream->matrix[i].in + 1, nports);
+					usage(argv[0], 1);
+				}
+			}
+			/* the matrix defines the channels written to the file */
+			stream->channels = stream->matrix[stream->ncells - 1].out + 1;
+		}
+		if (stream->channels == 0) {
+			fprintf(stderr, "No ports given for output file '%s'.\n", stream->path);
+			usage(argv[0], 1);
+		}
+		if (!stream->path || !strcmp(stream->path, "-")) {
+			if (to_stdout++) {
+				fprintf(stderr, "Only one stream can be written to standard-output.\n");
+				usage(argv[0], 1);
+			}
+			stream->fd = fileno(stdout);
+			continue;
+		}
+		stream->rotate = thread_info.rotate_interval > 0 || thread_info.rotate_length > 0;
+		path = stream->rotate ? output_filename(stream, 0, thread_info.start_time.tv_sec) : strdup(stream->path);
+		stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (stream->fd < 0) {
+			fprintf(stderr, "Can not open file '%s': %s\n", path, strerror(errno));
+			exit(1);
+		}
+		stream->files_opened = 1;
+		stream->cur_path = path;
 	}
 
-	/* bail out if buffer is smaller than twice the jack period */
-	if ((thread_info.rb_size>>1) < jack_get_buffer_size(thread_info.client)) {
-		fprintf(stderr, "Ringbuffer size needs to be at least twice jack period size\n");
-		jack_client_close(thread_info.client);
-		usage(argv[0], 1);
+	/* the io thread multiplexes all outputs with poll() */
+	for (s = 0; s < thread_info.nstreams; ++s) {
+		struct stat st;
+		stream = &thread_info.streams[s];
+		stream->fifo = !stream->rotate && fstat(stream->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#ifdef F_SETPIPE_SZ
+		if (stream->fifo && thread_info.low_latency) {
+			/* keep as little data as possible queued in the pipe */
+			fcntl(stream->fd, F_SETPIPE_SZ, 4096);
+		}
+#endif
+		stream->fdflags = fcntl(stream->fd, F_GETFL);
+		fcntl(stream->fd, F_SETFL, stream->fdflags | O_NONBLOCK);
+		if (thread_info.want_sparse && ((thread_info.format & 0x20) || !(thread_info.format & 0x10))
+				&& !(stream->fdflags & O_APPEND)) {
+			/* digital silence is all zero bytes in these formats */
+			stream->sparse = fstat(stream->fd, &st) == 0 && S_ISREG(st.st_mode)
+				&& lseek(stream->fd, 0, SEEK_CUR) >= 0;
+		}
+	}
+	if (pipe(wake_pipe)) {
+		fprintf(stderr, "Can not create pipe: %s\n", strerror(errno));
+		exit(1);
 	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
 
-	jack_set_process_callback(client, process, &thread_info);
-	jack_on_shutdown(client, jack_shutdown, &thread_info);
+	thread_info.channels = nports;
+	thread_info.source_names = port_names;
+	thread_info.encode = select_encoder(&thread_info, thread_info.dither);
+	thread_info.encode_silence = select_encoder(&thread_info, 0);
+	setup_buffers(thread_info.channels, &thread_info);
 
-	if (jack_activate(client)) {
-		fprintf(stderr, "cannot activate client");
+#ifdef HAVE_VMSPLICE
+	/* optional zero-copy output to pipes, resize the pipe to match the ringbuffer */
+	for (s = 0; s < thread_info.nstreams; ++s) {
+		stream = &thread_info.streams[s];
+		if (stream->fifo) {
+			stream->splice = thread_info.want_splice;
+			if (!thread_info.low_latency)
+				fcntl(stream->fd, F_SETPIPE_SZ, (int) stream->rb->size);
+		}
 	}
+#endif
 
-	setup_ports(thread_info.channels, &argv[optind], &thread_info);
+	/* set up JACK client */
+	switch (open_jack(&thread_info)) {
+		case 0:
+			break;
+		case -1:
+			fprintf(stderr, "Can not connect to JACK.\n");
+			exit(1);
+		default:
+			usage(argv[0], 1);
+	}
+
+	if (thread_info.seconds > 0) {
+		thread_info.duration = llrint(thread_info.seconds * thread_info.samplerate);
+	}
+
+	if (thread_info.rotate_interval > 0) {
+		/* first file ends at the next multiple of the interval (local time) */
+		struct tm tm;
+		localtime_r(&thread_info.start_time.tv_sec, &tm);
+		const time_t local = thread_info.start_time.tv_sec + tm.tm_gmtoff;
+		thread_info.rotate_boundary = thread_info.start_time.tv_sec
+			+ thread_info.rotate_interval - local % thread_info.rotate_interval;
+		/* the io thread sets the length of each file, when it starts */
+		for (s = 0; s < thread_info.nstreams; ++s) {
+			thread_info.streams[s].boundary = thread_info.rotate_boundary;
+		}
+	}
 
 	/* set up i/o thread */
 	pthread_create(&thread_info.thread_id, NULL, io_thread, &thread_info);
+	setup_io_thread(&thread_info);
 #ifndef _WIN32
 	signal (SIGHUP, catchsig);
 #endif
@@ -472,19 +1944,93 @@ int main (int argc, char **argv) {
 			(thread_info.format&0x20)?
 				(thread_info.format&0x40?"non-native-endian":"native-endian"):
 				(thread_info.format&0x40?"big-endian":"little-endian"),
-		  jack_get_sample_rate(thread_info.client)
+		  thread_info.samplerate
 		);
+		for (s = 0; (thread_info.nstreams > 1 || thread_info.streams[0].matrix) && s < thread_info.nstreams; ++s) {
+			stream = &thread_info.streams[s];
+			fprintf(stderr, " %s: %i channel%s\n",
+				stream->path ? stream->path : "stdout",
+				stream->channels, (stream->channels>1)?"s":"");
+		}
 	}
 
 	/* all systems go - run the i/o thread */
 	thread_info.can_capture = 1;
+	thread_info.rotate_pending = 1;
+
+	/* handle JACK notifications until the i/o thread terminates */
+	pthread_mutex_lock(&ctrl_lock);
+	while (!thread_info.io_done) {
+		if (thread_info.jack_lost) {
+			thread_info.jack_lost = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			reopen_jack(&thread_info);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		if (thread_info.rotate_pending) {
+			thread_info.rotate_pending = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			prepare_next_files(&thread_info);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		if (thread_info.connect_pending) {
+			thread_info.connect_pending = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			connect_ports(&thread_info, 0);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		if (thread_info.latency_pending) {
+			thread_info.latency_pending = 0;
+			pthread_mutex_unlock(&ctrl_lock);
+			if (thread_info.client && thread_info.can_process)
+				jack_recompute_total_latencies(thread_info.client);
+			pthread_mutex_lock(&ctrl_lock);
+			continue;
+		}
+		pthread_cond_wait(&ctrl_cond, &ctrl_lock);
+	}
+	pthread_mutex_unlock(&ctrl_lock);
 	pthread_join(thread_info.thread_id, NULL);
 
 	/* end - clean up */
-	if (overruns > 0 && !want_quiet) {
-		fprintf(stderr, "Note: there were %ld buffer overruns.\n", overruns);
+	if (atomic_load(&overruns) > 0 && !want_quiet) {
+		fprintf(stderr, "Note: there were %ld buffer overruns.\n", atomic_load(&overruns));
+	}
+	if (thread_info.client)
+		jack_client_close(thread_info.client);
+	for (s = 0; s < thread_info.nstreams; ++s) {
+		stream = &thread_info.streams[s];
+		fcntl(stream->fd, F_SETFL, stream->fdflags);
+		if (stream->fd != fileno(stdout))
+			close(stream->fd);
+		if (stream->next_fd >= 0) {
+			/* remove unused file that was opened ahead of time */
+			close(stream->next_fd);
+			if (stream->next_path && !(stream->cur_path && !strcmp(stream->next_path, stream->cur_path)))
+				unlink(stream->next_path);
+		}
+		if (stream->name_pending)
+			rename_file(stream);
+		free(stream->cur_path);
+		free(stream->next_path);
+		free(stream->frame);
+		free(stream->dither);
+		if (stream->matrix) {
+			unsigned int chn;
+			for (chn = 0; chn < stream->channels; ++chn)
+				free(stream->mix[chn]);
+			free(stream->mix);
+			free(stream->src);
+			free(stream->matrix);
+		}
+		jack_ringbuffer_free(stream->rb);
 	}
-	jack_client_close(client);
-	jack_ringbuffer_free(rb);
+	free(thread_info.streams);
+	for (s = 0; s < nports; ++s)
+		free(port_names[s]);
+	free(port_names);
 	return(0);
 }
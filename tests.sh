@@ -63,4 +63,70 @@ if true; then
   ./jack-stdout -d 3 -e float    -b 32 -B $INPORTS   | ./jack-stdin -e float    -b 32 -B $OUTPORTS
 fi
 
+if true; then
+	echo "testing gapless playback: ./jack-stdin -f a -f b"
+  D=$(mktemp -d)
+  sox $WAV -t raw -r 48k -e signed -b 16 -c 2 $D/a.raw trim 0 1.5
+  sox $WAV -t raw -r 48k -e signed -b 16 -c 2 $D/b.raw trim 1.5
+  ./jack-stdin -f $D/a.raw -f $D/b.raw $OUTPORTS
+  rm -rf $D
+fi
+
+if true; then
+	echo "testing multiple streams: ./jack-stdout -o file port -o - port"
+  D=$(mktemp -d)
+  ./jack-stdout -d 3 -o $D/l.raw system:capture_1 -o - system:capture_2 | ./jack-stdin system:playback_2
+  ./jack-stdin -f $D/l.raw system:playback_1
+  rm -rf $D
+fi
+
+if true; then
+	echo "testing --matrix: swap and mix channels, skip channels with --channels"
+  sox $WAV -t raw -r 48k -e signed -b 16 -c 2 - | ./jack-stdin -m 1=2,2=1 $OUTPORTS
+  sox $WAV -t raw -r 48k -e signed -b 16 -c 2 - | ./jack-stdin -m 1=1+2*-6dB,2=1*-6dB+2 $OUTPORTS
+  sox $WAV -t raw -r 48k -e signed -b 16 -c 4 - | ./jack-stdin -C 4 -m 1=1,2=2 $OUTPORTS
+fi
+
+if true; then
+	echo "testing frame counts: ./jack-stdout -c, ./jack-stdin -c"
+  D=$(mktemp -d)
+  ./jack-stdout -c 144000 $INPORTS > $D/c.raw
+  test $(wc -c < $D/c.raw) -eq 576000 && echo "captured 144000 frames"
+  ./jack-stdin -c 48000 -f $D/c.raw $OUTPORTS
+  rm -rf $D
+fi
+
+if true; then
+	echo "testing sparse round trip: ./jack-stdout -z -o file, ./jack-stdin -f file"
+  D=$(mktemp -d)
+  ./jack-stdout -d 3 -z -o $D/z.raw $INPORTS
+  ./jack-stdin -f $D/z.raw $OUTPORTS
+  rm -rf $D
+fi
+
+if true; then
+	echo "testing ./jack-stdout -F: file-names that repeat do not overwrite earlier files"
+  D=$(mktemp -d)
+  mkdir $D/r
+  ./jack-stdout -d 3 -F 12000 -o $D/r/%H%M%S.raw $INPORTS -o - $INPORTS > $D/pipe.raw
+  cat $(ls -tr $D/r/*) | cmp - $D/pipe.raw && echo "rotated files match the piped copy"
+  rm -rf $D
+fi
+
+if true; then
+	echo "testing ./jack-stdout -z: sparse file, rotation falls back to the current file"
+  D=$(mktemp -d)
+  for i in 1 2 3 4 5; do mkdir $D/s.raw.000$i; done
+  ./jack-stdout -d 3 -z -F 48000 -o $D/s.raw $INPORTS -o - $INPORTS > $D/pipe.raw
+  cmp $D/s.raw.0000 $D/pipe.raw && echo "sparse file matches the piped copy"
+  rm -rf $D
+fi
+
+if true; then
+	echo "benchmark: CPU time of ./jack-stdout, write() vs. vmsplice() (-Z), 10s of 32bit float"
+	echo "divide by the output size: 2 channels * 4 bytes * sample-rate * 10"
+  time ./jack-stdout -d 10 -e float    $INPORTS | dd bs=1M of=/dev/null status=none
+  time ./jack-stdout -d 10 -e float -Z $INPORTS | dd bs=1M of=/dev/null status=none
+fi
+
 test -n "$RM" && rm $WAV